@@ -9,6 +9,8 @@
     So approximately each iteration took 43sec to complete.
     Mind that this time includes the initialisation of vectors.
 */
+#include "../common/arena.c"
+#include "../common/rng.c"
 #include <stdio.h>
 #include <stdlib.h>
 // *********************************************************
@@ -20,18 +22,21 @@
 #define Nv 1000            // Number of dimensions of each generated vector.
 #define Nc 100             // Number of desired classes to group into.
 #define THRESHOLD 0.000001 // K-means convergeance threshold.
+#define STREAM_DATA 0      // Random streams of the dataset
+#define STREAM_CENTRES 1   // and of the initial centres.
+#define VEC_STRIDE ARENA_STRIDE(Nv, float) // Padded row length of vectors and centres.
 // GLOBAL VARS *********************************************
-float vectors[N][Nv];
-float centres[Nc][Nv];
+float (*vectors)[VEC_STRIDE]; // N vectors, allocated from arena
+float (*centres)[VEC_STRIDE]; // Nc centres, allocated from arena
+struct Arena arena;
 int classes[N];
 // **********************************************************
 
-// Initialises vectors to random normalized values.
+// Initialises vectors to random normalized values. Vector i holds draws
+// i * Nv to (i + 1) * Nv - 1 of the data stream.
 void initialiseVecs() {
     for (int i = 0; i < N; i++) {
-        for (int j = 0; j < Nv; j++) {
-            vectors[i][j] = 1.0 * rand() / RAND_MAX;
-        }
+        rngUniformArray(RNG_SEED, STREAM_DATA, (uint64_t)i * Nv, vectors[i], Nv);
     }
 }
 
@@ -48,9 +53,10 @@ void cpyVec(float *A, float *B) {
 void initCentres() {
     int temp[Nc];
     int sel, flag = 0;
+    struct Rng rng = rngStream(RNG_SEED, STREAM_CENTRES);
 
     for (int i = 0; i < Nc; i++) {
-        sel = rand() % N;
+        sel = rngBelow(&rng, N);
         for (int j = 0; j < i; j++) {
             if (sel == temp[j]) {
                 flag = 1;
@@ -148,6 +154,15 @@ void computeCentres() {
 int main() {
     float sumdist = 1e30, sumdistold;
     int i = 0;
+    // vectors and centres share one huge-page backed arena
+    size_t sizes[2] = {(size_t)N * sizeof(*vectors), (size_t)Nc * sizeof(*centres)};
+    void *arrays[2];
+    if (arenaInitArrays(&arena, ARENA_HUGE_PAGES, 2, sizes, arrays) != 0) {
+        printf("Could not allocate the vectors\n");
+        return 1;
+    }
+    vectors = arrays[0];
+    centres = arrays[1];
     initialiseVecs();
     initCentres();
     do {
@@ -157,6 +172,6 @@ int main() {
         computeCentres();
     } while ((sumdistold - sumdist) / sumdistold > THRESHOLD);
     printf("Total distance in loop %d is %0.2f\n", i, sumdist);
-
+    arenaFree(&arena);
     return 0;
 }
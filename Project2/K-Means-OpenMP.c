@@ -11,7 +11,16 @@
     to calculate incorrect results. This is unfortunate because that is the most 
     called function, so it would be most beneficial to parallelize it.I left the
     pragma clause I used commented for reference.
+
+    The classification loop runs on the persistent thread pool of
+    ../common/threadpool.c, whose work stealing also evens out the threads
+    when some of them are slowed down by other processes. Every vector stores
+    its minimum distance and they are summed in order afterwards, so the
+    result does not depend on which thread classified which vectors.
 */
+#include "../common/arena.c"
+#include "../common/rng.c"
+#include "../common/threadpool.c"
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,19 +30,26 @@
 #define Nv 1000            // Number of dimensions of each generated vector.
 #define Nc 100             // Number of desired classes to group into.
 #define THRESHOLD 0.000001 // K-means convergeance threshold.
+#define STREAM_DATA 0      // Random streams of the dataset
+#define STREAM_CENTRES 1   // and of the initial centres.
+#define VEC_STRIDE ARENA_STRIDE(Nv, float) // Padded row length of vectors and centres.
 #define NUM_CORES 8
+#define CLASSIFY_GRAIN 64  // vectors per chunk of the classification loop
 // GLOBAL VARS *********************************************
-float vectors[N][Nv];
-float centres[Nc][Nv];
+float (*vectors)[VEC_STRIDE]; // N vectors, allocated from arena
+float (*centres)[VEC_STRIDE]; // Nc centres, allocated from arena
+struct Arena arena;
 int classes[N];
+float minDists[N]; // distance of every vector to its centre
 // **********************************************************
 
-// Initialises vectors to random normalized values.
+// Initialises vectors to random normalized values. Vector i holds draws
+// i * Nv to (i + 1) * Nv - 1 of the data stream, so the dataset does not depend
+// on the number of threads.
 void initialiseVecs() {
+#pragma omp parallel for
     for (int i = 0; i < N; i++) {
-        for (int j = 0; j < Nv; j++) {
-            vectors[i][j] = 1.0 * rand() / RAND_MAX;
-        }
+        rngUniformArray(RNG_SEED, STREAM_DATA, (uint64_t)i * Nv, vectors[i], Nv);
     }
 }
 
@@ -51,9 +67,10 @@ void cpyVec(float *A, float *B) {
 void initCentres() {
     int temp[Nc];
     int sel, flag = 0;
+    struct Rng rng = rngStream(RNG_SEED, STREAM_CENTRES);
 
     for (int i = 0; i < Nc; i++) {
-        sel = rand() % N;
+        sel = rngBelow(&rng, N);
         for (int j = 0; j < i; j++) {
             if (sel == temp[j]) {
                 flag = 1;
@@ -86,13 +103,12 @@ float dist(float *A, float *B) {
 }
 
 // **********************************************************
-// Classifies each example vector by finding the centroid with the shortest distance
-// to it. This function returns the sum of all the minimum distances in order to check for convergeance.
-float computeClasses() {
+// Classifies the vectors [from, to) and stores their minimum distances in
+// the array arg.
+void classifyVectors(long from, long to, void *arg) {
+    float *dists = arg;
     float tempdist = 0;
-    float sumdists = 0;
-    #pragma omp parallel for private(tempdist) reduction(+:sumdists) shared(classes)
-    for (int i = 0; i < N; i++) {
+    for (int i = from; i < to; i++) {
         float min = 1.0 * RAND_MAX;
         for (int j = 0; j < Nc; j++) {
             tempdist = dist(&vectors[i][0], &centres[j][0]);
@@ -101,7 +117,18 @@ float computeClasses() {
                 min = tempdist;
             }
         }
-        sumdists += min;
+        dists[i] = min;
+    }
+}
+
+// **********************************************************
+// Classifies each example vector by finding the centroid with the shortest distance
+// to it. This function returns the sum of all the minimum distances in order to check for convergeance.
+float computeClasses() {
+    float sumdists = 0;
+    poolFor(0, N, CLASSIFY_GRAIN, classifyVectors, minDists);
+    for (int i = 0; i < N; i++) {
+        sumdists += minDists[i];
     }
     return sumdists;
 }
@@ -157,6 +184,21 @@ void computeCentres() {
 int main() {
     float sumdist = 1e30, sumdistold;
     int i = 0;
+    // vectors and centres share one huge-page backed arena
+    size_t sizes[2] = {(size_t)N * sizeof(*vectors), (size_t)Nc * sizeof(*centres)};
+    void *arrays[2];
+    if (arenaInitArrays(&arena, ARENA_HUGE_PAGES, 2, sizes, arrays) != 0) {
+        printf("Could not allocate the vectors\n");
+        return 1;
+    }
+    vectors = arrays[0];
+    centres = arrays[1];
+    if (poolStart(omp_get_max_threads()) != 0) {
+        printf("Could not start the thread pool\n");
+        poolStop();
+        arenaFree(&arena);
+        return 1;
+    }
     initialiseVecs();
     initCentres();
     do {
@@ -166,6 +208,7 @@ int main() {
         printf("Total distance in loop %d is %0.2f\n", i, sumdist);
         computeCentres();
     } while ((sumdistold - sumdist) / sumdistold > THRESHOLD);
-
+    poolStop();
+    arenaFree(&arena);
     return 0;
 }
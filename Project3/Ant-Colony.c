@@ -18,19 +18,45 @@
     
     The serial implementation ran for about 80 minutes on the same machine
     so we have reduced the runtime by a factor of 4.
-    
+
+    The loop above runs in lockstep: the 8 ants walk in parallel, then the
+    pheromones of all N^2 edges are updated, so the cores wait for the
+    slowest ant and then for a sweep that scans the routes of every ant for
+    every edge. The asynchronous colony (the default, -DASYNC_COLONY=0 for
+    the loop above) has no phases. Every thread builds tours one after the
+    other and deposits 1 / length on the edges of a tour as soon as it is
+    finished. Every N_AGENTS finished tours form a generation, which
+    advances the colony clock by one step, and the convergence test is run
+    on the generations. Evaporation is lazy: every edge packs its pheromone
+    with the clock step it was last updated at in 64 bits, a read applies
+    the evaporation of the steps since then, and a deposit replaces both
+    with a compare-and-swap. No edge is touched unless an ant reads it or
+    walks it. Both modes print the ant tours per second.
 */
+#include "../common/arena.c"
+#include "../common/rng.c"
 #include <math.h>
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 // **********************************************************
 // DEFINITIONS
+#ifndef N_POINTS
 #define N_POINTS 10000              //Number of cities to generate
+#endif
 #define N_AGENTS 8                  // Number of ant agents
 #define P 0.5                       // Pheromone evaporation rate
 #define PHEROMONE_INIT_VAL (float)1 // Initial pheromone values
+#define STREAM_CITIES 0             // Random stream of the city coordinates,
+#define STREAM_ANTS 1               // ant i draws from stream STREAM_ANTS + i
+#define PHEROMONE_STRIDE ARENA_STRIDE(N_POINTS, float) // Padded row length of pheromones
+#ifndef ASYNC_COLONY
+#define ASYNC_COLONY 1 // asynchronous colony with lazy evaporation, 0 = lockstep iterations
+#endif
+#define TRAIL_STRIDE ARENA_STRIDE(N_POINTS, uint64_t) // Padded row length of trails
+#define DECAY_STEPS 256 // evaporation table length, (1 - P)^DECAY_STEPS is 0 in a float
 // **********************************************************
 // STRUCTS
 struct AntAgent {
@@ -39,6 +65,7 @@ struct AntAgent {
     int route[N_POINTS];
     int initialCity;
     int currentCity;
+    struct Rng rng; // private random stream
 };
 // **********************************************************
 // GLOBAL VARS
@@ -46,43 +73,87 @@ float cities[N_POINTS][2] = {0};
 float minPathLength = 0;
 float avgPathLength = 0;
 struct AntAgent ants[N_AGENTS];
-float pheromones[N_POINTS][N_POINTS];
-unsigned int seed = 159852753;
+float (*pheromones)[PHEROMONE_STRIDE]; // allocated from a huge-page backed arena
+uint64_t (*trails)[TRAIL_STRIDE];      // pheromones of the asynchronous colony, with their clock step
+float decay[DECAY_STEPS];              // evaporation over a number of clock steps
+unsigned int colonyClock = 0;          // generations finished by the asynchronous colony
+int colonyDone = 0;
+struct Arena arena;
 
-// **********************************************************
-// Random unsigned int generator
-unsigned int randUint() {
-#pragma omp threadprivate(seed)
-    seed = seed * 1103515245 + 12345;
-    return seed;
-}
 // **********************************************************
 // Initialises the city coordinate vectors.
 void initVec() {
+    rngUniformArray(RNG_SEED, STREAM_CITIES, 0, &cities[0][0], 2 * N_POINTS);
     for (int i = 0; i < N_POINTS; i++) {
-        cities[i][0] = (float)rand() / RAND_MAX * 1e3;
-        cities[i][1] = (float)rand() / RAND_MAX * 1e3;
+        cities[i][0] *= 1e3;
+        cities[i][1] *= 1e3;
     }
 }
-// Initialises pheromones.
-void initPheromones() {
+// Packs a pheromone value with the clock step it is valid at.
+static inline uint64_t packTrail(float value, unsigned int step) {
+    union {
+        float f;
+        uint32_t u;
+    } v = {value};
+    return (uint64_t)step << 32 | v.u;
+}
+// Returns the pheromone value of a packed trail.
+static inline float trailValue(uint64_t trail) {
+    union {
+        uint32_t u;
+        float f;
+    } v = {(uint32_t)trail};
+    return v.f;
+}
+// Allocates and initialises pheromones. Returns 0 on success.
+int initPheromones() {
+    size_t size = ASYNC_COLONY ? (size_t)N_POINTS * sizeof(*trails) : (size_t)N_POINTS * sizeof(*pheromones);
+    if (arenaInit(&arena, size, ARENA_HUGE_PAGES) != 0)
+        return -1;
+    if (ASYNC_COLONY)
+        trails = arenaAlloc(&arena, size);
+    else
+        pheromones = arenaAlloc(&arena, size);
 #pragma omp parallel for
     for (int i = 0; i < N_POINTS; i++) {
         for (int j = 0; j < N_POINTS; j++) {
-            pheromones[i][j] = PHEROMONE_INIT_VAL;
+            if (ASYNC_COLONY)
+                trails[i][j] = packTrail(PHEROMONE_INIT_VAL, 0);
+            else
+                pheromones[i][j] = PHEROMONE_INIT_VAL;
         }
     }
+    for (int d = 0; d < DECAY_STEPS; d++) {
+        decay[d] = pow(1 - P, d);
+    }
+    return 0;
+}
+// Returns the pheromone of the edge i -> j at clock step now.
+static inline float pheromoneAt(int i, int j, unsigned int now) {
+    if (!ASYNC_COLONY)
+        return pheromones[i][j];
+    uint64_t trail = __atomic_load_n(&trails[i][j], __ATOMIC_RELAXED);
+    int age = now - (unsigned int)(trail >> 32); // negative if deposited after now
+    if (age <= 0)
+        return trailValue(trail);
+    return age < DECAY_STEPS ? trailValue(trail) * decay[age] : 0;
+}
+// Places an ant on a random city with all the others available.
+void resetAgent(struct AntAgent *ant) {
+    ant->pathLength = 0;
+    memset(&ant->city_flags[0], 1, N_POINTS * sizeof(int));
+    int register tmp = rngBelow(&ant->rng, N_POINTS);
+    ant->initialCity = tmp;
+    ant->currentCity = tmp;
+    ant->route[0] = tmp;
+    ant->city_flags[tmp] = 0;
 }
-// Resets each ant's parameters.
+// Resets each ant's parameters. Every ant keeps walking its own random
+// stream across iterations, so the tours do not depend on the thread that
+// runs them.
 void resetAgents() {
     for (int i = 0; i < N_AGENTS; i++) {
-        ants[i].pathLength = 0;
-        memset(&ants[i].city_flags[0], 1, N_POINTS * sizeof(int));
-        int register tmp = (int)rand() % N_POINTS;
-        ants[i].initialCity = tmp;
-        ants[i].currentCity = tmp;
-        ants[i].route[0] = tmp;
-        ants[i].city_flags[tmp] = 0;
+        resetAgent(&ants[i]);
     }
 }
 // **********************************************************
@@ -93,44 +164,49 @@ float dist(int p1, int p2) {
     return (float)sqrt(dx * dx + dy * dy);
 }
 
-// Make each agent run through all the cities according to the algorithm's rules.
-void releaseAgents() {
-#pragma omp parallel for
-    for (int i = 0; i < N_AGENTS; i++) {
-        float city_probs[N_POINTS] = {0};
-        for (int j = 0; j < N_POINTS - 1; j++) {
-            int register curr = ants[i].currentCity;
-            float prob = (float)randUint() / __UINT32_MAX__;
-            float denominator = 0;
-            //First pass from all available cities.
-            for (int k = 0; k < N_POINTS; k++) {
-                if (ants[i].city_flags[k]) {
-                    float len = dist(curr, k);
-                    len = 1.0 / len;
-                    float register tmp = sqrt(pheromones[curr][k] * len);
-                    /*ants[i].*/ city_probs[k] = tmp;
-                    denominator += tmp;
-                }
+// Make an agent run through all the cities according to the algorithm's
+// rules, reading the pheromones at clock step now.
+void walkAgent(struct AntAgent *ant, unsigned int now) {
+    float city_probs[N_POINTS] = {0};
+    for (int j = 0; j < N_POINTS - 1; j++) {
+        int register curr = ant->currentCity;
+        float prob = rngFloat(&ant->rng);
+        float denominator = 0;
+        //First pass from all available cities.
+        for (int k = 0; k < N_POINTS; k++) {
+            if (ant->city_flags[k]) {
+                float len = dist(curr, k);
+                len = 1.0 / len;
+                float register tmp = sqrt(pheromoneAt(curr, k, now) * len);
+                city_probs[k] = tmp;
+                denominator += tmp;
             }
-            prob *= denominator;
-            float cumulativeProb = 0;
-            // Probabilistic choice of next city to visit.
-            for (int k = 0; k < N_POINTS; k++) {
-                if (ants[i].city_flags[k]) {
-                    cumulativeProb += city_probs[k];
-                    if (prob < cumulativeProb) {
-                        // Move to city
-                        ants[i].city_flags[k] = 0;
-                        ants[i].pathLength += dist(curr, k);
-                        ants[i].currentCity = k;
-                        ants[i].route[j + 1] = k;
-                        break;
-                    }
+        }
+        prob *= denominator;
+        float cumulativeProb = 0;
+        // Probabilistic choice of next city to visit.
+        for (int k = 0; k < N_POINTS; k++) {
+            if (ant->city_flags[k]) {
+                cumulativeProb += city_probs[k];
+                if (prob < cumulativeProb) {
+                    // Move to city
+                    ant->city_flags[k] = 0;
+                    ant->pathLength += dist(curr, k);
+                    ant->currentCity = k;
+                    ant->route[j + 1] = k;
+                    break;
                 }
             }
         }
-        //printf("agent = %d\tcurrCity = %d\tinitCity = %d\n",i,ants[i].currentCity,ants[i].initialCity);
-        ants[i].pathLength += dist(ants[i].currentCity, ants[i].initialCity);
+    }
+    ant->pathLength += dist(ant->currentCity, ant->initialCity);
+}
+
+// Make each agent run through all the cities according to the algorithm's rules.
+void releaseAgents() {
+#pragma omp parallel for
+    for (int i = 0; i < N_AGENTS; i++) {
+        walkAgent(&ants[i], 0);
     }
 }
 
@@ -160,17 +236,100 @@ void updatePheromones() {
     }
 }
 
+// Deposits the pheromone of a finished tour on its edges at clock step now.
+// Concurrent deposits on the same edge are merged by the compare-and-swap.
+void depositTour(const struct AntAgent *ant, unsigned int now) {
+    float amount = 1.0 / ant->pathLength;
+    for (int q = 0; q < N_POINTS; q++) {
+        uint64_t *trail = &trails[ant->route[q]][ant->route[(q + 1) % N_POINTS]];
+        uint64_t old = __atomic_load_n(trail, __ATOMIC_RELAXED), new;
+        do {
+            unsigned int step = (unsigned int)(old >> 32);
+            int age = now - step;
+            float value = trailValue(old);
+            if (age <= 0) // a later deposit already moved the edge to step
+                new = packTrail(value + (-age < DECAY_STEPS ? amount * decay[-age] : 0), step);
+            else
+                new = packTrail((age < DECAY_STEPS ? value * decay[age] : 0) + amount, now);
+        } while (!__atomic_compare_exchange_n(trail, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+
+// Runs the asynchronous colony until the average path length of a
+// generation changes by less than 1%. Returns the number of tours counted
+// in the generations, or -1 if an ant could not be allocated.
+long runAsyncColony() {
+    float sum = 0, min = 0;
+    int inGeneration = 0, failed = 0;
+    long started = 0, tours = 0;
+#pragma omp parallel
+    {
+        struct AntAgent *ant = malloc(sizeof(struct AntAgent));
+        if (ant == NULL) {
+            failed = 1;
+            __atomic_store_n(&colonyDone, 1, __ATOMIC_RELEASE);
+        }
+        while (!__atomic_load_n(&colonyDone, __ATOMIC_ACQUIRE)) {
+            long tour = __atomic_fetch_add(&started, 1, __ATOMIC_RELAXED);
+            ant->rng = rngStream(RNG_SEED, STREAM_ANTS + tour); // every tour has its own stream
+            resetAgent(ant);
+            walkAgent(ant, __atomic_load_n(&colonyClock, __ATOMIC_ACQUIRE));
+            depositTour(ant, __atomic_load_n(&colonyClock, __ATOMIC_ACQUIRE));
+#pragma omp critical
+            if (!__atomic_load_n(&colonyDone, __ATOMIC_RELAXED)) { // tours that finish after convergence are not counted
+                tours++;
+                min = inGeneration == 0 || ant->pathLength < min ? ant->pathLength : min;
+                sum += ant->pathLength;
+                if (++inGeneration == N_AGENTS) {
+                    float prevAvg = avgPathLength;
+                    avgPathLength = sum / N_AGENTS;
+                    minPathLength = min;
+                    if (fabs(avgPathLength - prevAvg) / prevAvg <= 0.01)
+                        __atomic_store_n(&colonyDone, 1, __ATOMIC_RELEASE);
+                    __atomic_add_fetch(&colonyClock, 1, __ATOMIC_RELEASE);
+                    sum = 0;
+                    inGeneration = 0;
+                }
+            }
+        }
+        free(ant);
+    }
+    return failed ? -1 : tours;
+}
+
 int main() {
-#pragma omp threadprivate(seed)
     float prevAvg = 1e9;
     float sum = 0;
     int iter = 1; //iteration number
     initVec();
-    initPheromones();
+    if (initPheromones() != 0) {
+        printf("Could not allocate the pheromones\n");
+        return 1;
+    }
+    for (int i = 0; i < N_AGENTS; i++) {
+        ants[i].rng = rngStream(RNG_SEED, STREAM_ANTS + i);
+    }
     printf("INITIALIZED EVERYTHING\n");
+    double start = omp_get_wtime(), walkTime = 0;
+    if (ASYNC_COLONY) {
+        long tours = runAsyncColony();
+        if (tours < 0) {
+            printf("Could not allocate the ants\n");
+            arenaFree(&arena);
+            return 1;
+        }
+        double elapsed = omp_get_wtime() - start;
+        printf("Generations: %u\tMin Path Length: %.2f\tAverage Path: %.2f\n", colonyClock, minPathLength,
+               avgPathLength);
+        printf("Asynchronous colony: %ld ant tours in %.2f s, %.3f tours/s\n", tours, elapsed, tours / elapsed);
+        arenaFree(&arena);
+        return 0;
+    }
     do {
         resetAgents();
+        double t = omp_get_wtime();
         releaseAgents();
+        walkTime += omp_get_wtime() - t;
         updatePheromones();
         minPathLength = ants[0].pathLength;
         sum = ants[0].pathLength;
@@ -186,5 +345,9 @@ int main() {
         iter++;
     } while (abs(avgPathLength - prevAvg) / prevAvg > 0.01);
     printf("Iterations: %d\tMin Path Length: %.2f\tAverage Path: %.2f\n", iter, minPathLength, avgPathLength);
+    double elapsed = omp_get_wtime() - start;
+    printf("Synchronous loop: %d ant tours in %.2f s (%.2f s walking), %.3f tours/s\n", (iter - 1) * N_AGENTS,
+           elapsed, walkTime, (iter - 1) * N_AGENTS / elapsed);
+    arenaFree(&arena);
     return 0;
 }
\ No newline at end of file
@@ -13,7 +13,14 @@
     Not a noticable improvement over the serial implementation, which
     is due to the fact that this algorithm is not really parallelizable
     and also the problem is NP-hard.
+
+    Each move only scans the remaining cities once, so it is too short for a
+    fresh parallel region and a critical section per city. The scan runs on
+    the persistent thread pool of ../common/threadpool.c instead: every thread
+    keeps its own two closest cities and they are merged after the loop.
 */
+#include "../common/rng.c"
+#include "../common/threadpool.c"
 #include <math.h>
 #include <omp.h>
 #include <stdio.h>
@@ -22,19 +29,34 @@
 // DEFINITIONS
 #define N_POINTS 10000
 #define THRESHOLD 0.8
+#define CITY_GRAIN 256 // cities per chunk of the parallel scan
+#define STREAM_CITIES 0 // random streams of the city coordinates
+#define STREAM_MOVES 1  // and of the choices between the two closest cities
+// **********************************************************
+// STRUCTS
+// The two closest available cities found by one thread.
+struct Candidates {
+    float mindist1;
+    float mindist2;
+    int index1;
+    int index2;
+} __attribute__((aligned(64)));
 // **********************************************************
 // GLOBAL VARS
 float cities[N_POINTS][2] = {0};  // Matrix which holds the coordinates of each city
 short city_flags[N_POINTS] = {0}; //available = 1, visited = 0
 float totDist = 0;                // Total route distance
 int curr_index = 0;               // The index of the city we are in on each iteration.
+struct Candidates candidates[POOL_MAX_THREADS]; // Per-thread results of the scan
+struct Rng moveRng;                             // Draws of the choices between candidates
 // **********************************************************
 // Initialises the city coordinate vectors.
 void initVec() {
+    rngUniformArray(RNG_SEED, STREAM_CITIES, 0, &cities[0][0], 2 * N_POINTS);
     for (int i = 0; i < N_POINTS; i++) {
         city_flags[i] = 1;
-        cities[i][0] = (float)rand() / RAND_MAX * 1e3;
-        cities[i][1] = (float)rand() / RAND_MAX * 1e3;
+        cities[i][0] *= 1e3;
+        cities[i][1] *= 1e3;
     }
 }
 // **********************************************************
@@ -45,35 +67,52 @@ float dist(int p1, int p2) {
     return (float)sqrt(dx * dx + dy * dy);
 }
 
+// **********************************************************
+// Inserts a city into a list of the two closest ones.
+static inline void addCandidate(struct Candidates *c, int i, float tmpDist) {
+    if (tmpDist < c->mindist1) {
+        c->mindist2 = c->mindist1;
+        c->index2 = c->index1;
+        c->index1 = i;
+        c->mindist1 = tmpDist;
+    }
+    else if (tmpDist < c->mindist2) {
+        c->mindist2 = tmpDist;
+        c->index2 = i;
+    }
+}
+
+// **********************************************************
+// Scans the cities [from, to) for the two closest available ones, kept in
+// the calling thread's entry of the array arg.
+void scanCities(long from, long to, void *arg) {
+    struct Candidates *c = (struct Candidates *)arg + poolThreadId();
+    for (int i = from; i < to; i++) {
+        if (city_flags[i] == 1) {
+            addCandidate(c, i, dist(curr_index, i));
+        }
+    }
+}
+
 // **********************************************************
 // Performs one iteration of the algorithm, finding the closest city
 // and moving to it.
 float moveCity() {
-    int index1, index2;
-    float register mindist1 = 100e3;
-    float register mindist2 = 100e3;
-#pragma omp parallel for
-    for (int i = 1; i < N_POINTS; i++) {
-        if (city_flags[i] == 1) {
-            float register tmpDist = dist(curr_index, i);
-#pragma omp critical
-            {
-                if (tmpDist < mindist1) {
-
-                    mindist2 = mindist1;
-                    index2 = index1;
-                    index1 = i;
-                    mindist1 = tmpDist;
-                }
-
-                else if (tmpDist < mindist2) {
-                    mindist2 = tmpDist;
-                    index2 = i;
-                }
-            }
-        }
+    struct Candidates best = {100e3, 100e3, -1, -1};
+    for (int t = 0; t < poolSize(); t++) {
+        candidates[t] = best;
+    }
+    poolFor(1, N_POINTS, CITY_GRAIN, scanCities, candidates);
+    for (int t = 0; t < poolSize(); t++) {
+        if (candidates[t].index1 >= 0)
+            addCandidate(&best, candidates[t].index1, candidates[t].mindist1);
+        if (candidates[t].index2 >= 0)
+            addCandidate(&best, candidates[t].index2, candidates[t].mindist2);
     }
-    if ((float)rand() / RAND_MAX < THRESHOLD) {
+    int index1 = best.index1, index2 = best.index2;
+    float mindist1 = best.mindist1, mindist2 = best.mindist2;
+    // with a single city left, it is the only choice
+    if (rngFloat(&moveRng) < THRESHOLD || index2 < 0) {
         city_flags[index1] = 0;
         curr_index = index1;
         return mindist1;
@@ -86,13 +125,19 @@ float moveCity() {
 }
 
 int main() {
+    if (poolStart(omp_get_max_threads()) != 0) {
+        printf("Could not start the thread pool\n");
+        poolStop();
+        return 1;
+    }
     initVec();
+    moveRng = rngStream(RNG_SEED, STREAM_MOVES);
     totDist += moveCity();
     for (int i = 0; i < N_POINTS - 2; i++) {
         totDist += moveCity();
     }
     totDist += dist(curr_index, 0);
     printf("Final total distance: %.2f\n", totDist);
-
+    poolStop();
     return 0;
 }
@@ -15,6 +15,7 @@ and also the problem is NP-hard.
 
 NOTE: The moveCity function is loop dependant and thus can't be parallelized.
 */
+#include "../common/rng.c"
 #include <math.h>
 #include <omp.h>
 #include <stdio.h>
@@ -23,20 +24,24 @@ NOTE: The moveCity function is loop dependant and thus can't be parallelized.
 // DEFINITIONS
 #define N_POINTS 10000 // Number of cities to generate
 #define ITERATIONS 1e9 // Number of iterations to execute
+#define STREAM_CITIES 0 // Random streams of the city coordinates
+#define STREAM_MOVES 1  // and of the swapped cities.
 // **********************************************************
 // GLOBAL VARS
 float cities[N_POINTS][2] = {0};
 int route[N_POINTS + 1] = {0};
 float totDist = 0;
+struct Rng moveRng;
 
 // **********************************************************
 // Initialises the city coordinate vectors and the chosen route
 // between them.
 void initVec() {
+    rngUniformArray(RNG_SEED, STREAM_CITIES, 0, &cities[0][0], 2 * N_POINTS);
     for (int i = 0; i < N_POINTS; i++) {
         route[i] = i;
-        cities[i][0] = (float)rand() / RAND_MAX * 1e3;
-        cities[i][1] = (float)rand() / RAND_MAX * 1e3;
+        cities[i][0] *= 1e3;
+        cities[i][1] *= 1e3;
     }
     route[N_POINTS] = 0;
 }
@@ -55,8 +60,8 @@ void moveCity() {
     int register index1, index2;
     float tempDist = totDist;
     do {
-        index1 = 1 + rand() % (N_POINTS - 1);
-        index2 = 1 + rand() % (N_POINTS - 1);
+        index1 = 1 + rngBelow(&moveRng, N_POINTS - 1);
+        index2 = 1 + rngBelow(&moveRng, N_POINTS - 1);
     } while (index1 == index2);
     int register point1 = route[index1];
     int register point2 = route[index2];
@@ -99,6 +104,7 @@ void moveCity() {
 
 int main() {
     initVec();
+    moveRng = rngStream(RNG_SEED, STREAM_MOVES);
     // initial total distance calculation
 #pragma omp parallel for reduction(+:totDist)
     for (int i = 0; i < N_POINTS; i++) {
@@ -0,0 +1,547 @@
+/*
+Description:
+Parallel spatial decomposition solver for the travelling salesman problem.
+
+The other solvers of this project treat all the cities as one problem, and
+every move depends on the previous one, so they can not use more than a core
+or two. Here the square the cities lie in is cut into a grid of regions of
+about REGION_CITIES cities each, and:
+
+1. The regions are ordered along a closed snake: along the bottom row, back
+   and forth over the other columns of the rows above it, and down the first
+   column (the grid has an even number of rows). Consecutive regions share a
+   side and the last region touches the first. A region enters at its city
+   closest to the middle of the side it shares with the previous region, and
+   exits at its city closest to the middle of the side it shares with the
+   next one.
+2. Every region is solved on its own: an open path from its entry to its exit
+   is built with the Heinritz-Hsiao rule (move to the closest unvisited city,
+   or to the second closest with probability 1 - THRESHOLD) and improved with
+   2-opt moves between every city and its NEIGHBOURS closest cities, the two
+   endpoints staying fixed.
+3. The paths are joined in snake order into one tour, every exit to the next
+   entry.
+4. The seams are refined: the SEAM_WINDOW cities on each side of every seam
+   form a path with fixed endpoints that is improved with the same 2-opt.
+   The windows of different seams do not overlap.
+
+Steps 2 and 4 run in parallel over the regions and the seams. A region only
+costs O(REGION_CITIES^2), so the run time grows linearly with the number of
+cities, and with thousands of regions on a dynamic schedule the threads stay
+busy until the end. Every region draws from its own random stream, so the
+tour is the same for any number of threads.
+
+The tour length is compared with 0.7124 * sqrt(N * A), the length of an
+optimal tour through N random cities of an area A for large N.
+With -DN_POINTS=10000 the cities are the ones of the other solvers.
+*/
+#include "../common/rng.c"
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef N_POINTS
+#define N_POINTS 1000000 // Number of cities to generate
+#endif
+#define SIDE 1e3f          // Side of the square the cities lie in
+#define REGION_CITIES 256  // Average number of cities per region
+#define THRESHOLD 0.8      // Probability of moving to the closest city
+#define NEIGHBOURS 8       // Candidate cities of the 2-opt moves of a city
+#define MAX_PASSES 50      // Maximum 2-opt sweeps over a path
+#define SEAM_WINDOW 64     // Cities on each side of a seam refined together
+#define STREAM_CITIES 0    // Random streams of the city coordinates
+#define STREAM_REGIONS 1   // and of the moves in each region (STREAM_REGIONS + region).
+// **********************************************************
+// STRUCTS
+// Per-thread buffers of the path functions, for paths of up to cap cities.
+struct Scratch {
+    int cap;
+    int *ids;      // cities of the path, in their original order
+    float (*xy)[2];// and their coordinates
+    int *order;    // the path, as indices into ids
+    int *pos;      // position of every index in order
+    int *nbr;      // NEIGHBOURS closest indices of every index
+    int *nnbr;     // number of neighbours of every index
+    char *visited;
+};
+// **********************************************************
+// GLOBAL VARS
+float cities[N_POINTS][2] = {0}; // Matrix which holds the coordinates of each city
+int tour[N_POINTS] = {0};        // Cities grouped by region in snake order, then the tour
+int grid;                        // Regions per side of the grid
+int *cellRow, *cellCol;          // Grid cell of every region, in snake order
+int *regionStart;                // First position of every region in tour, and N_POINTS
+
+// **********************************************************
+// Initialises the city coordinate vectors.
+void initVec() {
+    rngUniformArray(RNG_SEED, STREAM_CITIES, 0, &cities[0][0], 2 * N_POINTS);
+    for (int i = 0; i < N_POINTS; i++) {
+        cities[i][0] *= SIDE;
+        cities[i][1] *= SIDE;
+    }
+}
+// **********************************************************
+// Euclidean distance calculation between 2 points in the grid.
+float dist(int p1, int p2) {
+    float register dx = cities[p1][0] - cities[p2][0];
+    float register dy = cities[p1][1] - cities[p2][1];
+    return (float)sqrt(dx * dx + dy * dy);
+}
+
+// **********************************************************
+// Squared distance between 2 cities of a path in the scratch buffers, enough
+// to compare distances.
+static inline float localDist2(const struct Scratch *s, int a, int b) {
+    float register dx = s->xy[a][0] - s->xy[b][0];
+    float register dy = s->xy[a][1] - s->xy[b][1];
+    return dx * dx + dy * dy;
+}
+
+// **********************************************************
+// Distance between 2 cities of a path in the scratch buffers.
+static inline float localDist(const struct Scratch *s, int a, int b) {
+    return sqrtf(localDist2(s, a, b));
+}
+
+// **********************************************************
+// Orders the cells of the grid along the closed snake. Returns 0 on success,
+// -1 if out of memory.
+int snakeOrder() {
+    int k = 0;
+    cellRow = malloc(grid * grid * sizeof(int));
+    cellCol = malloc(grid * grid * sizeof(int));
+    if (cellRow == NULL || cellCol == NULL)
+        return -1;
+    for (int c = 0; c < grid; c++, k++) {
+        cellRow[k] = 0;
+        cellCol[k] = c;
+    }
+    for (int r = 1; r < grid; r++) {
+        for (int c = 1; c < grid; c++, k++) {
+            cellRow[k] = r;
+            cellCol[k] = r % 2 == 1 ? grid - c : c;
+        }
+    }
+    for (int r = grid - 1; r > 0; r--, k++) {
+        cellRow[k] = r;
+        cellCol[k] = 0;
+    }
+    return 0;
+}
+
+// **********************************************************
+// Groups the cities by region (counting sort on their region). Returns 0 on
+// success, -1 if out of memory.
+int bucketCities() {
+    int nRegions = grid * grid;
+    int *regionOf = malloc(grid * grid * sizeof(int)); // region of every cell
+    int *cityRegion = malloc(N_POINTS * sizeof(int));
+    int *next = malloc(nRegions * sizeof(int));
+    regionStart = calloc(nRegions + 1, sizeof(int));
+    if (regionOf == NULL || cityRegion == NULL || next == NULL || regionStart == NULL) {
+        free(next);
+        free(cityRegion);
+        free(regionOf);
+        return -1;
+    }
+    for (int k = 0; k < nRegions; k++) {
+        regionOf[cellRow[k] * grid + cellCol[k]] = k;
+    }
+#pragma omp parallel for
+    for (int i = 0; i < N_POINTS; i++) {
+        int r = (int)(cities[i][1] * grid / SIDE), c = (int)(cities[i][0] * grid / SIDE);
+        cityRegion[i] = regionOf[(r < grid ? r : grid - 1) * grid + (c < grid ? c : grid - 1)];
+    }
+    for (int i = 0; i < N_POINTS; i++) {
+        regionStart[cityRegion[i] + 1]++;
+    }
+    for (int k = 0; k < nRegions; k++) {
+        regionStart[k + 1] += regionStart[k];
+    }
+    for (int k = 0; k < nRegions; k++) {
+        next[k] = regionStart[k];
+    }
+    for (int i = 0; i < N_POINTS; i++) {
+        tour[next[cityRegion[i]]++] = i;
+    }
+    free(next);
+    free(cityRegion);
+    free(regionOf);
+    return 0;
+}
+
+// **********************************************************
+// Allocates the buffers of a thread. Returns 0 on success, -1 if out of
+// memory (the buffers must still be freed with freeScratch).
+int initScratch(struct Scratch *s, int cap) {
+    s->cap = cap;
+    s->ids = malloc(cap * sizeof(int));
+    s->xy = malloc(cap * sizeof(*s->xy));
+    s->order = malloc(cap * sizeof(int));
+    s->pos = malloc(cap * sizeof(int));
+    s->nbr = malloc(cap * NEIGHBOURS * sizeof(int));
+    s->nnbr = malloc(cap * sizeof(int));
+    s->visited = malloc(cap);
+    if (s->ids == NULL || s->xy == NULL || s->order == NULL || s->pos == NULL || s->nbr == NULL || s->nnbr == NULL ||
+        s->visited == NULL)
+        return -1;
+    return 0;
+}
+
+// **********************************************************
+void freeScratch(struct Scratch *s) {
+    free(s->ids);
+    free(s->xy);
+    free(s->order);
+    free(s->pos);
+    free(s->nbr);
+    free(s->nnbr);
+    free(s->visited);
+}
+
+// **********************************************************
+// Copies the path of n cities to the buffers, in its current order.
+void loadPath(struct Scratch *s, const int *path, int n) {
+    for (int k = 0; k < n; k++) {
+        s->ids[k] = path[k];
+        s->xy[k][0] = cities[path[k]][0];
+        s->xy[k][1] = cities[path[k]][1];
+        s->order[k] = k;
+    }
+}
+
+// **********************************************************
+// Writes the improved order of the path back.
+void storePath(const struct Scratch *s, int *path, int n) {
+    for (int k = 0; k < n; k++) {
+        path[k] = s->ids[s->order[k]];
+    }
+}
+
+// **********************************************************
+// Builds a path from index 0 to index n - 1 with the Heinritz-Hsiao rule.
+void buildPath(struct Scratch *s, int n, struct Rng *rng) {
+    for (int k = 0; k < n; k++) {
+        s->visited[k] = 0;
+    }
+    int curr = 0;
+    for (int step = 1; step < n - 1; step++) {
+        float mindist1 = INFINITY, mindist2 = INFINITY;
+        int index1 = -1, index2 = -1;
+        for (int k = 1; k < n - 1; k++) {
+            if (s->visited[k])
+                continue;
+            float tmpDist = localDist2(s, curr, k);
+            if (tmpDist < mindist1) {
+                mindist2 = mindist1;
+                index2 = index1;
+                mindist1 = tmpDist;
+                index1 = k;
+            }
+            else if (tmpDist < mindist2) {
+                mindist2 = tmpDist;
+                index2 = k;
+            }
+        }
+        // with a single city left, it is the only choice
+        curr = rngFloat(rng) < THRESHOLD || index2 < 0 ? index1 : index2;
+        s->visited[curr] = 1;
+        s->order[step] = curr;
+    }
+    s->order[n - 1] = n - 1;
+}
+
+// **********************************************************
+// Finds the NEIGHBOURS closest cities of every city of the path.
+void findNeighbours(struct Scratch *s, int n) {
+    float nd[NEIGHBOURS];
+    for (int a = 0; a < n; a++) {
+        int *nb = s->nbr + a * NEIGHBOURS;
+        int m = 0;
+        for (int b = 0; b < n; b++) {
+            if (b == a)
+                continue;
+            float d = localDist2(s, a, b);
+            if (m == NEIGHBOURS && d >= nd[m - 1])
+                continue;
+            int k = m < NEIGHBOURS ? m++ : m - 1;
+            for (; k > 0 && nd[k - 1] > d; k--) {
+                nd[k] = nd[k - 1];
+                nb[k] = nb[k - 1];
+            }
+            nd[k] = d;
+            nb[k] = b;
+        }
+        s->nnbr[a] = m;
+    }
+}
+
+// **********************************************************
+// Reverses the positions [lo, hi] of the path.
+static inline void reverse(struct Scratch *s, int lo, int hi) {
+    for (; lo < hi; lo++, hi--) {
+        int a = s->order[lo], b = s->order[hi];
+        s->order[lo] = b;
+        s->order[hi] = a;
+        s->pos[b] = lo;
+        s->pos[a] = hi;
+    }
+}
+
+// **********************************************************
+// Tries the 2-opt moves that replace an edge of city a by an edge to one of
+// its neighbours. Returns 1 if one was applied.
+int improveCity(struct Scratch *s, int n, int a) {
+    const int *nb = s->nbr + a * NEIGHBOURS;
+    int i = s->pos[a];
+    // edges (a, next) and (c, next of c) become (a, c) and (next, next of c)
+    if (i + 1 < n) {
+        int b = s->order[i + 1];
+        float dab = localDist(s, a, b);
+        for (int k = 0; k < s->nnbr[a]; k++) {
+            int c = nb[k], j = s->pos[c];
+            float dac = localDist(s, a, c);
+            if (dac >= dab)
+                break;
+            if (j + 1 >= n || c == b)
+                continue;
+            int d = s->order[j + 1];
+            if (dab + localDist(s, c, d) - dac - localDist(s, b, d) > 1e-3f) {
+                if (i < j)
+                    reverse(s, i + 1, j);
+                else
+                    reverse(s, j + 1, i);
+                return 1;
+            }
+        }
+    }
+    // edges (previous, a) and (previous of c, c) become (a, c) and (previous, previous of c)
+    if (i > 0) {
+        int b = s->order[i - 1];
+        float dab = localDist(s, a, b);
+        for (int k = 0; k < s->nnbr[a]; k++) {
+            int c = nb[k], j = s->pos[c];
+            float dac = localDist(s, a, c);
+            if (dac >= dab)
+                break;
+            if (j == 0 || c == b)
+                continue;
+            int d = s->order[j - 1];
+            if (dab + localDist(s, c, d) - dac - localDist(s, b, d) > 1e-3f) {
+                if (i < j)
+                    reverse(s, i, j - 1);
+                else
+                    reverse(s, j, i - 1);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Improves the path with 2-opt moves, keeping its endpoints, until no move
+// shortens it or MAX_PASSES sweeps are done.
+void twoOpt(struct Scratch *s, int n) {
+    findNeighbours(s, n);
+    for (int k = 0; k < n; k++) {
+        s->pos[s->order[k]] = k;
+    }
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        int improved = 0;
+        for (int a = 0; a < n; a++) {
+            improved |= improveCity(s, n, a);
+        }
+        if (!improved)
+            break;
+    }
+}
+
+// **********************************************************
+// Returns the city of the path closest to (x, y), other than skip.
+int closestCity(const int *path, int n, float x, float y, int skip) {
+    float mindist = INFINITY;
+    int index = -1;
+    for (int k = 0; k < n; k++) {
+        float dx = cities[path[k]][0] - x, dy = cities[path[k]][1] - y;
+        if (k != skip && dx * dx + dy * dy < mindist) {
+            mindist = dx * dx + dy * dy;
+            index = k;
+        }
+    }
+    return index;
+}
+
+// **********************************************************
+// Moves the city at position k of the path to position to.
+static inline void moveTo(int *path, int k, int to) {
+    int tmp = path[to];
+    path[to] = path[k];
+    path[k] = tmp;
+}
+
+// **********************************************************
+// Solves region k: replaces its cities in tour by a path from its entry to
+// its exit.
+void solveRegion(int k, struct Scratch *s) {
+    int nRegions = grid * grid;
+    int *path = tour + regionStart[k];
+    int n = regionStart[k + 1] - regionStart[k];
+    if (n <= 1)
+        return;
+    int prev = (k + nRegions - 1) % nRegions, next = (k + 1) % nRegions;
+    float cell = SIDE / grid;
+    // the middle of a shared side is the middle of the centres of the 2 cells
+    float inX = (cellCol[k] + cellCol[prev] + 1) * cell / 2, inY = (cellRow[k] + cellRow[prev] + 1) * cell / 2;
+    float outX = (cellCol[k] + cellCol[next] + 1) * cell / 2, outY = (cellRow[k] + cellRow[next] + 1) * cell / 2;
+    moveTo(path, closestCity(path, n, inX, inY, -1), 0);
+    moveTo(path, closestCity(path, n, outX, outY, 0), n - 1);
+    struct Rng rng = rngStream(RNG_SEED, STREAM_REGIONS + k);
+    loadPath(s, path, n);
+    buildPath(s, n, &rng);
+    twoOpt(s, n);
+    storePath(s, path, n);
+}
+
+// **********************************************************
+// Refines the seam at the start of region k. The window stops at the middle
+// of both regions, so that it does not overlap the other seams.
+void refineSeam(int k, struct Scratch *s, int *window) {
+    int nRegions = grid * grid, prev = (k + nRegions - 1) % nRegions;
+    int before = (regionStart[prev + 1] - regionStart[prev]) / 2;
+    int after = (regionStart[k + 1] - regionStart[k]) / 2;
+    before = before < SEAM_WINDOW ? before : SEAM_WINDOW;
+    after = after < SEAM_WINDOW ? after : SEAM_WINDOW;
+    int n = before + after;
+    if (n < 4)
+        return;
+    int first = regionStart[k] - before + N_POINTS;
+    for (int j = 0; j < n; j++) {
+        window[j] = tour[(first + j) % N_POINTS];
+    }
+    loadPath(s, window, n);
+    twoOpt(s, n);
+    storePath(s, window, n);
+    for (int j = 0; j < n; j++) {
+        tour[(first + j) % N_POINTS] = window[j];
+    }
+}
+
+// **********************************************************
+// Returns the length of the closed tour.
+double tourLength() {
+    double totDist = 0;
+#pragma omp parallel for reduction(+:totDist)
+    for (int i = 0; i < N_POINTS; i++) {
+        totDist += dist(tour[i], tour[(i + 1) % N_POINTS]);
+    }
+    return totDist;
+}
+
+int main() {
+    int nThreads = omp_get_max_threads();
+    double *busy = calloc(nThreads, sizeof(double)); // time every thread spent on regions and seams
+    int failed = 0;
+    if (busy == NULL) {
+        printf("Could not allocate the thread times\n");
+        return 1;
+    }
+    initVec();
+    grid = (int)ceil(sqrt((double)N_POINTS / REGION_CITIES));
+    grid += grid % 2; // the closed snake needs an even number of rows
+    grid = grid < 2 ? 2 : grid;
+    int nRegions = grid * grid;
+    printf("%d cities, %d x %d regions of %.0f cities on average, %d threads\n", N_POINTS, grid, grid,
+           (double)N_POINTS / nRegions, nThreads);
+
+    double start = omp_get_wtime();
+    if (snakeOrder() != 0 || bucketCities() != 0) {
+        printf("Could not allocate the regions\n");
+        return 1;
+    }
+    int cap = 2 * SEAM_WINDOW;
+    for (int k = 0; k < nRegions; k++) {
+        int n = regionStart[k + 1] - regionStart[k];
+        cap = n > cap ? n : cap;
+    }
+    double bucketTime = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+#pragma omp parallel
+    {
+        struct Scratch s;
+        if (initScratch(&s, cap) != 0) {
+#pragma omp atomic write
+            failed = 1;
+        }
+        // every thread must agree on skipping the loop below
+#pragma omp barrier
+        int skip;
+#pragma omp atomic read
+        skip = failed;
+        double t = omp_get_wtime();
+        if (!skip) {
+#pragma omp for schedule(dynamic) nowait
+            for (int k = 0; k < nRegions; k++) {
+                solveRegion(k, &s);
+            }
+        }
+        busy[omp_get_thread_num()] += omp_get_wtime() - t;
+        freeScratch(&s);
+    }
+    if (failed) {
+        printf("Could not allocate the region buffers\n");
+        return 1;
+    }
+    double regionTime = omp_get_wtime() - start;
+    double stitchedDist = tourLength();
+
+    start = omp_get_wtime();
+#pragma omp parallel
+    {
+        struct Scratch s;
+        int *window = malloc(2 * SEAM_WINDOW * sizeof(int));
+        if (initScratch(&s, 2 * SEAM_WINDOW) != 0 || window == NULL) {
+#pragma omp atomic write
+            failed = 1;
+        }
+#pragma omp barrier
+        int skip;
+#pragma omp atomic read
+        skip = failed;
+        double t = omp_get_wtime();
+        if (!skip) {
+#pragma omp for schedule(dynamic) nowait
+            for (int k = 0; k < nRegions; k++) {
+                refineSeam(k, &s, window);
+            }
+        }
+        busy[omp_get_thread_num()] += omp_get_wtime() - t;
+        freeScratch(&s);
+        free(window);
+    }
+    if (failed) {
+        printf("Could not allocate the seam buffers\n");
+        return 1;
+    }
+    double seamTime = omp_get_wtime() - start;
+    double totDist = tourLength();
+
+    double busyTime = 0;
+    for (int t = 0; t < nThreads; t++) {
+        busyTime += busy[t];
+    }
+    printf("Bucketing: %.3f s, regions: %.3f s, seams: %.3f s, core utilisation %.0f%%\n", bucketTime, regionTime,
+           seamTime, 100 * busyTime / (nThreads * (regionTime + seamTime)));
+    printf("Stitched total distance: %.2f\n", stitchedDist);
+    printf("Final total distance: %.2f (%.3f x the expected optimum)\n", totDist,
+           totDist / (0.7124 * sqrt((double)N_POINTS * SIDE * SIDE)));
+    free(busy);
+    free(regionStart);
+    free(cellRow);
+    free(cellCol);
+    return 0;
+}
@@ -15,213 +15,545 @@
 */
 // **********************************************************
 // DEFINITIONS
-#define NL1 100            // 1st layer size
-#define NL2 10             // output layer size
 #define NINPUT 784         //input size
+#define NCLASSES 10        //number of classes, size of the output layer
+#define DEFAULT_TOPOLOGY "100:logistic,10:logistic" //hidden and output layers, "size:activation" list
 #define NTRAIN 60000       //training set size
 #define NTEST 10000        //testing set size
+#ifndef ITERATIONS
 #define ITERATIONS 500     //number of epochs
+#endif
 #define ALPHA (double)0.05 //learning rate
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 1       //mini-batch size, 1 = original per-sample training
+#endif
+#define MODE_SAMPLE 0      //per-sample SGD, parallelised inside the layers
+#define MODE_BATCH 1       //mini-batch SGD on blocked matrix products (minibatch.c)
+#define MODE_HOGWILD 2     //lock-free data-parallel SGD (hogwild.c)
+#define MODE_DISTRIBUTED 3 //mini-batch SGD across NWORKERS processes (distributed.c)
+#ifndef TRAIN_MODE
+#define TRAIN_MODE (BATCH_SIZE > 1 ? MODE_BATCH : MODE_SAMPLE)
+#endif
+#ifndef BENCH_SAMPLES
+#define BENCH_SAMPLES 0    //if >0, compare the training modes' throughput on this many samples
+#endif
+#ifndef MODEL_PATH
+#define MODEL_PATH "./model.nn" //where the trained network is saved
+#endif
+#define ROW_GRAIN 4        //neurons per chunk of the per-sample loops
+#ifndef SPARSE_INPUT
+#define SPARSE_INPUT 1     //per-sample path runs the first layer on the nonzero pixels only (sparse.c)
+#endif
+#define SPARSE_GRAIN (128 / (int)sizeof(nn_weight)) //neurons per chunk of the sparse first layer loops
+#define DATA_STRIDE ARENA_STRIDE(NINPUT,unsigned char) //padded row length of the staged images
+#define STREAM_WEIGHTS 0                   //random stream of the initial weights of layer l: STREAM_WEIGHTS + l
+#define STREAM_SHUFFLE (1ULL << 48)        //streams of the shuffles of the training runs
+#define STREAM_HOGWILD (2ULL << 48)        //streams of the samples picked by the hogwild runs
+#define STREAM_DISTRIBUTED (3ULL << 48)    //streams of the shards' shuffles of the distributed workers
 // **********************************************************
 // INCLUDES
+#include "../common/threadpool.c"
+#include "../common/rng.c"
+#include "../common/arena.c"
+#include "precision.c"
+#include "activations.c"
 #include "extra_functions.c"
+#include "dataset.c"
+#include "layers.c"
+#include "model.c"
 #include <math.h>
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 // **********************************************************
 // GLOBAL VARS
-double WL1[NL1][NINPUT + 1];
-double WL2[NL2][NL1 + 1];
-// layer internal states
-double DL1[NL1];
-double DL2[NL2];
+struct Network net;
 // layer outputs
-double OL1[NL1];
-double OL2[NL2];
+nn_real *layerOut[MAX_LAYERS];
 // layer deltas
-double delta2[NL2];
-double delta1[NL1];
-//data
-double data_train[NTRAIN][NINPUT];
-double data_test[NTEST][NINPUT];
+nn_real *layerDelta[MAX_LAYERS];
+// number of weight updates so far, used to salt the stochastic rounding of bf16 weights
+unsigned int updateStep = 0;
+// training runs so far, each one draws its samples from its own random stream
+uint64_t trainingRuns = 0;
+//data, raw pixels staged from the dataset caches into padded rows of dataArena
+const unsigned char (*data_train)[DATA_STRIDE];
+const unsigned char (*data_test)[DATA_STRIDE];
+struct Arena dataArena;
 int class_train[NTRAIN];
 int class_test[NTEST];
-double input[NINPUT];
+nn_real input[NINPUT];
+struct FeatureStats stats_train; //normalisation statistics of the training set, used for every input
+// **********************************************************
+// MODULES
+#include "profile.c"
+#include "minibatch.c"
+#include "sparse.c"
+#include "prefetch.c"
+#include "hogwild.c"
+#include "distributed.c"
+#include "inference.c"
+#include "quantize.c"
+// **********************************************************
+// A sample being run through the network by a pool job.
+struct SampleJob
+{
+    const nn_real *in;
+    int inputClass;
+    unsigned int step;
+    const nn_real *x; //input of the layer of the current row loop
+    int l;            //layer of the current row loop
+    const struct SparseSample *sp; //nonzero pixels of the input if the first layer is folded, or NULL
+};
+
+// **********************************************************
+// Computes the outputs of neurons [from,to) of the current layer.
+void forwardRows(long from, long to, void *arg){
+    struct SampleJob *job = arg;
+    struct Layer *L = &net.layer[job->l];
+    for (long i = from; i < to; i++)
+    {
+        const nn_weight *w = L->W + (size_t)i * L->ld;
+        nn_real register sum = L->k.dot(w,job->x,L->nin);
+        sum += LOADW(w[L->nin]); //add bias neuron weight
+        layerOut[job->l][i] = activate(L->act,sum);
+    }
+}
+
+// **********************************************************
+// Computes the outputs of neurons [from,to) of the folded first layer from
+// the nonzero pixels of the sample.
+void sparseForwardRows(long from, long to, void *arg){
+    struct SampleJob *job = arg;
+    struct Layer *L = &net.layer[0];
+    sparseForward(job->sp,from,to,layerOut[0]);
+    for (long i = from; i < to; i++)
+    {
+        layerOut[0][i] = activate(L->act,layerOut[0][i]);
+    }
+}
+
+// **********************************************************
+// Runs every layer on the sample of the job. Called by every thread of a pool
+// job, the neurons of each layer are split between them.
+void forwardNN(struct SampleJob *job){
+    job->x = job->in;
+    for (int l = 0; l < net.nlayers; l++)
+    {
+        struct Layer *L = &net.layer[l];
+        job->l = l;
+        if (l == 0 && job->sp != NULL)
+        {
+            poolFor(0,L->nout,SPARSE_GRAIN,sparseForwardRows,job);
+        }
+        else
+        {
+            poolFor(0,L->nout,ROW_GRAIN,forwardRows,job);
+        }
+        if (L->act == ACT_SOFTMAX)
+        {
+            if (poolThreadId() == 0)
+            {
+                softmaxArray(layerOut[l],L->nout);
+            }
+            poolBarrier();
+        }
+        job->x = layerOut[l];
+    }
+}
+
+// **********************************************************
+void activateJob(void *arg){
+    struct SampleJob job = *(struct SampleJob *)arg; //every thread keeps its own loop state
+    forwardNN(&job);
+}
+
 // **********************************************************
 // Implements the feedforward part of the Neural Network using the vector "in" as input. 
-void activateNN(double *in){
-    // layer1
-    #pragma omp parallel for
-    for (int i = 0; i < NL1; i++)
+void activateNN(const nn_real *in){
+    struct SampleJob job = {.in = in};
+    poolRun(activateJob,&job);
+}
+
+// **********************************************************
+// Same as activateNN for a sample given by its nonzero pixels. The first
+// layer must be folded (foldInputLayer).
+void activateSparseNN(const struct SparseSample *sp){
+    struct SampleJob job = {.sp = sp};
+    poolRun(activateJob,&job);
+}
+
+// **********************************************************
+// Computes the deltas of inputs [from,to) of the current layer, i.e. of the
+// neurons of the previous layer.
+void backwardRows(long from, long to, void *arg){
+    struct SampleJob *job = arg;
+    int l = job->l;
+    struct Layer *L = &net.layer[l];
+    for (long i = from; i < to; i++)
     {
-        double register sum = 0;
-        for (int j = 0; j < NINPUT; j++)
+        nn_real register sum = 0;
+        for (int j = 0; j < L->nout; j++)
         {
-            sum += WL1[i][j] * in[j];
+            sum += LOADW(L->W[(size_t)j * L->ld + i]) * layerDelta[l][j];
         }
-        sum += WL1[i][NINPUT]; //add bias neuron weight
-        DL1[i] = sum;
-        OL1[i] = logistic(sum);
+        nn_real register Oi = layerOut[l-1][i];
+        layerDelta[l-1][i] = sum * activateDerivative(net.layer[l-1].act,Oi);
     }
-    // layer2
-    #pragma omp parallel for
-    for (int i = 0; i < NL2; i++)
+}
+
+// **********************************************************
+// Updates the weights of neurons [from,to), numbered across all layers.
+void updateRows(long from, long to, void *arg){
+    struct SampleJob *job = arg;
+    nn_real register lr = ALPHA;
+    int l = 0;
+    long first = 0; //number of the first neuron of layer l
+    for (long k = from; k < to; k++)
     {
-        double register sum = 0;
-        for (int j = 0; j < NL1; j++)
+        while (k >= first + net.layer[l].nout)
         {
-            sum += WL2[i][j] * OL1[j];
+            first += net.layer[l++].nout;
         }
-        sum += WL2[i][NL1]; //add bias neuron weight
-        DL2[i] = sum;
-        OL2[i] = logistic(sum);
+        struct Layer *L = &net.layer[l];
+        const nn_real *x = l == 0 ? job->in : layerOut[l-1];
+        long i = k - first;
+        nn_weight *w = L->W + (size_t)i * L->ld;
+        nn_real register g = -lr * layerDelta[l][i];
+        L->k.updateRow(w,g,x,rowSalt(job->step,l,i),L->nin);
+        STOREW(w[L->nin], LOADW(w[L->nin]) + g, rowSalt(job->step,l,i) + L->nin);//update bias neuron weight
     }
 }
 
-void trainNN(double *in,double *desired){
-   
+// **********************************************************
+// Updates neurons [from,to) of the folded first layer.
+void sparseUpdateRows(long from, long to, void *arg){
+    struct SampleJob *job = arg;
+    sparseUpdate(job->sp,from,to,layerDelta[0],ALPHA,job->step);
+}
+
+// **********************************************************
+// Pool job of trainNN: every phase is a loop split between the threads.
+void trainJob(void *arg){
+    struct SampleJob job = *(struct SampleJob *)arg;
+    int last = net.nlayers - 1;
+    long neurons = 0, first = 0;
+    PROFILE_START(t);
     // Calculate Neural Network outputs
-    activateNN(in);
+    forwardNN(&job);
+    PROFILE_LAP(t,PHASE_FORWARD,0);
     // Output layer deltas
-    #pragma omp parallel
+    if (poolThreadId() == 0)
     {
-    #pragma omp for
-    for (int i = 0; i < NL2; i++)
+        lossSum += outputDelta(net.layer[last].act,layerOut[last],job.inputClass,layerDelta[last]);
+        lossCount++;
+    }
+    poolBarrier();
+    // Hidden layer deltas
+    for (int l = last; l > 0; l--)
     {
-        delta2[i] = (OL2[i]-desired[i])*OL2[i]*(1-OL2[i]);
+        job.l = l;
+        poolFor(0,net.layer[l].nin,ROW_GRAIN,backwardRows,&job);
     }
-    // Layer 1 Deltas
-    #pragma omp for
-    for (int i = 0; i < NL1; i++)
+    PROFILE_LAP(t,PHASE_BACKWARD,0);
+    // update weights of every layer, in one loop over all their neurons
+    for (int l = 0; l < net.nlayers; l++)
     {
-        double register sum = 0;
-        for (int j = 0; j < NL2; j++)
-        {
-            sum += WL2[j][i] * delta2[j];
-        }
-        double register Oi = OL1[i];
-        delta1[i] = sum * Oi * (1-Oi);
+        neurons += net.layer[l].nout;
     }
+    if (job.sp != NULL)
+    {
+        poolFor(0,net.layer[0].nout,SPARSE_GRAIN,sparseUpdateRows,&job);
+        first = net.layer[0].nout;
     }
-    
-    #pragma omp parallel
+    poolFor(first,neurons,ROW_GRAIN,updateRows,&job);
+    PROFILE_LAP(t,PHASE_UPDATE,0);
+}
+
+// **********************************************************
+// Trains the network on a single sample of class inputClass.
+void trainNN(const nn_real *in,int inputClass){
+    struct SampleJob job = {.in = in,.inputClass = inputClass,.step = ++updateStep};
+    poolRun(trainJob,&job);
+    phaseTimers.jobs++;
+}
+
+// **********************************************************
+// Same as trainNN for a sample given by its nonzero pixels. The first layer
+// must be folded (foldInputLayer).
+void trainSparseNN(const struct SparseSample *sp,int inputClass){
+    struct SampleJob job = {.inputClass = inputClass,.step = ++updateStep,.sp = sp};
+    poolRun(trainJob,&job);
+    phaseTimers.jobs++;
+}
+// **********************************************************
+// Trains the network for numSamples samples using the given training mode
+// and returns the achieved samples/s. The per-sample and mini-batch modes go
+// through shuffled epochs of the training set, prefetched in the background.
+double timeTraining(long numSamples, int mode){
+    struct Prefetcher pipe;
+    const nn_real *in;
+    const int *classes;
+    int n;
+    double start = omp_get_wtime();
+    if (mode == MODE_SAMPLE)
     {
-    // update weights of layer 2
-    #pragma omp for nowait
-    for (int i = 0; i < NL2; i++)
+        // falls back to the dense first layer if the folded one cannot be allocated
+        int sparse = SPARSE_INPUT && foldInputLayer(&net,&stats_train) == 0;
+        if (SPARSE_INPUT && !sparse)
+        {
+            printf("Could not fold the first layer, training on dense inputs\n");
+        }
+        if (startPrefetcher(&pipe,data_train,class_train,&stats_train,NTRAIN,PREFETCH_BATCH,numSamples,STREAM_SHUFFLE + trainingRuns++,sparse) != 0)
+        {
+            printf("Could not start the input pipeline\n");
+            return 0;
+        }
+        PROFILE_START(t);
+        while ((n = nextBatch(&pipe,&in,&classes)) > 0)
+        {
+            PROFILE_LAP(t,PHASE_INPUT,0);
+            for (int i = 0; i < n; i++)
+            {
+                if (sparse)
+                {
+                    trainSparseNN(sparseBatch(&pipe) + i,classes[i]);
+                }
+                else
+                {
+                    trainNN(in + (size_t)i * NINPUT,classes[i]);
+                }
+            }
+            PROFILE_RESET(t);
+        }
+        stopPrefetcher(&pipe);
+        if (sparse)
+        {
+            unfoldInputLayer(&net,updateStep);
+        }
+    }
+    else if (mode == MODE_BATCH)
     {
-        for (int j = 0; j < NL1; j++)
+        if (startPrefetcher(&pipe,data_train,class_train,&stats_train,NTRAIN,BATCH_SIZE,numSamples,STREAM_SHUFFLE + trainingRuns++,0) != 0)
+        {
+            printf("Could not start the input pipeline\n");
+            return 0;
+        }
+        PROFILE_START(t);
+        while ((n = nextBatch(&pipe,&in,&classes)) > 0)
         {
-            WL2[i][j] -= ALPHA * OL1[j] * delta2[i];
+            PROFILE_LAP(t,PHASE_INPUT,0);
+            trainBatchNN(in,classes,n);
+            PROFILE_RESET(t);
         }
-        WL2[i][NL1] -= ALPHA * delta2[i];//update bias neuron weight
+        stopPrefetcher(&pipe);
     }
-    // update weights of layer 1
-    #pragma omp for
-    for (int i = 0; i < NL1; i++)
+    else if (mode == MODE_HOGWILD)
     {
-        for (int j = 0; j < NINPUT; j++)
+        if (trainHogwild(numSamples,omp_get_max_threads()) != 0)
         {
-            WL1[i][j] -= ALPHA * in[j] * delta1[i];
+            printf("Hogwild training failed\n");
         }
-        WL1[i][NINPUT] -= ALPHA * delta1[i];//update bias neuron weight
     }
+    else if (trainDistributed(numSamples,NWORKERS) != 0)
+    {
+        printf("Distributed training failed\n");
     }
+    return numSamples / (omp_get_wtime() - start);
 }
+
 // **********************************************************
-// Evaluates which class the network predicts that the input belongs to
-// by finding the argmax of the output layer. 
-// Afterwards it updates the confusion matrix with the prediction.
-void evaluate(int inputClass,double confMatrix[NL2][NL2]){
-    int maxIndex = 0;
-    double maxVal = 0;
-    for (int i = 0; i < NL2; i++)
+// Trains the network for the given number of epochs. After every epoch the
+// network is evaluated on the testing set and the epoch is logged to
+// EPOCH_LOG. Returns the training throughput in samples/s, evaluation excluded.
+double trainEpochs(int epochs, int mode){
+    FILE *log = fopen(EPOCH_LOG,"w");
+    uint64_t first[N_COUNTERS], before[N_COUNTERS], after[N_COUNTERS], total[N_COUNTERS];
+    double trainSeconds = 0;
+    if (log == NULL)
     {
-        if (maxVal<OL2[i])
+        printf("Could not open %s, the epochs are not logged\n",EPOCH_LOG);
+    }
+    memset(&phaseTimers,0,sizeof(phaseTimers));
+    perfRead(&perfCounters,first);
+    for (int e = 1; e <= epochs; e++)
+    {
+        struct PhaseTimers phasesBefore = phaseTimers;
+        double confusionMatrix[NCLASSES][NCLASSES] = {{0}};
+        double register correct = 0;
+        lossSum = 0;
+        lossCount = 0;
+        perfRead(&perfCounters,before);
+        double start = omp_get_wtime();
+        timeTraining(NTRAIN,mode);
+        double seconds = omp_get_wtime() - start;
+        perfRead(&perfCounters,after);
+        trainSeconds += seconds;
+        if (inferBatch(&net,data_test,&stats_train,NTEST,NULL,class_test,confusionMatrix) != 0)
+        {
+            printf("Could not allocate the inference buffers, epoch %d is not evaluated\n",e);
+            continue;
+        }
+        for (int i = 0; i < NCLASSES; i++)
         {
-            maxVal = OL2[i];
-            maxIndex = i;
+            correct += confusionMatrix[i][i];
         }
+        double loss = lossCount > 0 ? lossSum / lossCount : 0;
+        printf("Epoch %d: loss %.4f, testing hit rate %0.3f, %.0f samples/s\n",e,loss,correct / NTEST,NTRAIN / seconds);
+        logEpoch(log,e,NTRAIN,seconds,loss,correct / NTEST,&phasesBefore,before,after);
     }
-    //Edge case where both the correct output layer and another one have the same output value, we consider that a correct classification.
-    if (maxVal==OL2[inputClass])
+    perfRead(&perfCounters,total);
+    for (int c = 0; c < N_COUNTERS; c++)
     {
-        maxIndex = inputClass;
+        total[c] -= first[c];
     }
-    confMatrix[maxIndex][inputClass]++;
+    printProfile(trainSeconds,total);
+    if (log != NULL)
+    {
+        fclose(log);
+    }
+    return (double)NTRAIN * epochs / trainSeconds;
 }
 
 // **********************************************************
-// Normalizes the input data into normal distribution N(0,1)
-void normalizeData(double in[][NINPUT],int inSize){
-    double average[NINPUT] = {0};
-    double var[NINPUT] = {0};
-    #pragma omp parallel for
-    for (int i = 0; i < NINPUT; i++)
+// Measures the training throughput of every mode on the same weights, and the
+// scaling of the Hogwild mode with the number of threads.
+// The weights are restored afterwards so training is unaffected.
+void benchmarkTraining(long numSamples){
+    struct Network saved;
+    if (cloneNetwork(&saved,&net) != 0)
+    {
+        printf("Could not copy the network, the training benchmark is skipped\n");
+        return;
+    }
+    double perSample = timeTraining(numSamples,MODE_SAMPLE);
+    printf("Per-sample throughput: %.0f samples/s\n",perSample);
+    if (BATCH_SIZE > 1)
     {
-        for (int j = 0; j < inSize; j++)//calculate mean
+        copyWeights(&net,&saved);
+        double batched = timeTraining(numSamples,MODE_BATCH);
+        printf("Mini-batch (%d) throughput: %.0f samples/s (x%.2f)\n",BATCH_SIZE,batched,batched/perSample);
+    }
+    double hogwild1 = 0;
+    for (int t = 1; ; t *= 2)
+    {
+        if (t > omp_get_max_threads())
+        {
+            t = omp_get_max_threads();
+        }
+        copyWeights(&net,&saved);
+        double start = omp_get_wtime();
+        if (trainHogwild(numSamples,t) != 0)
         {
-            average[i] += in[j][i];
+            printf("Hogwild training failed\n");
+            break;
         }
-        average[i] /= inSize;
-        double register mean = average[i];
-        for (int j = 0; j < inSize; j++)//calculate variance
+        double hogwild = numSamples / (omp_get_wtime() - start);
+        if (t == 1)
         {
-            var[i] += (in[j][i] - mean)*(in[j][i] - mean);
+            hogwild1 = hogwild;
+        }
+        printf("Hogwild (%d threads) throughput: %.0f samples/s (x%.2f, scaling efficiency %.2f)\n",
+            t,hogwild,hogwild/perSample,hogwild/(hogwild1*t));
+        if (t == omp_get_max_threads())
+        {
+            break;
         }
-        var[i] /= inSize-1;
     }
-    #pragma omp parallel for
-    for (int i = 0; i < NINPUT; i++)
+    if (BATCH_SIZE > 1)
     {
-        double register mean = average[i];
-        double register stddev = sqrt(var[i]);
-        for (int j = 0; j < inSize; j++)
+        double distributed1 = 0;
+        for (int w = 1; w <= NWORKERS; w++)
         {
-            in[j][i] -= mean;
-            in[j][i] /= stddev;
+            copyWeights(&net,&saved);
+            double start = omp_get_wtime();
+            trainDistributed(numSamples,w);
+            double distributed = numSamples / (omp_get_wtime() - start);
+            if (w == 1)
+            {
+                distributed1 = distributed;
+            }
+            printf("Distributed (%d workers) throughput: %.0f samples/s (x%.2f, scaling efficiency %.2f)\n",
+                w,distributed,distributed/perSample,distributed/(distributed1*w));
         }
     }
+    printf("\n");
+    copyWeights(&net,&saved);
+    freeNetwork(&saved);
 }
+
 // **********************************************************
-int main() {
-    double desiredOut[NL2]={0};
-    double confusionMatrixTrain[NL2][NL2]= {0};
-    double confusionMatrixTest[NL2][NL2]= {0};
-    readfile("./DATA/fashion-mnist_train.csv",class_train,data_train,NTRAIN);
-    readfile("./DATA/fashion-mnist_test.csv",class_test,data_test,NTEST);
-    normalizeData(data_test,NTEST);
-    normalizeData(data_train,NTRAIN);
-    initVecs();//initialise weights
-    for (int i = 0; i < NL2; i++)//initialise desired vector values
+int main(int argc, char *argv[]) {
+    double confusionMatrixTrain[NCLASSES][NCLASSES]= {0};
+    double confusionMatrixTest[NCLASSES][NCLASSES]= {0};
+    //the argument is either a saved model, which is used without training, or a topology
+    const char *arg = argc > 1 ? argv[1] : DEFAULT_TOPOLOGY;
+    if (poolStart(omp_get_max_threads()) != 0)//threads of the per-sample path
     {
-        desiredOut[i] = 0.1;
+        printf("Could not start the thread pool\n");
+        poolStop();
+        return 1;
     }
-    int register tmp = 0;
-    for (int i = 0; i < NTRAIN*ITERATIONS; i++)//train the nn
+    perfOpen(&perfCounters);//before the prefetch thread is started
+    measureRegionCost();
+    int pretrained = access(arg,R_OK) == 0;
+    if (pretrained ? loadModel(&net,&stats_train,arg) != 0 : buildNetwork(&net,arg) != 0)
     {
-        tmp = rand()%NTRAIN;
-        desiredOut[class_train[tmp]] = 0.9;
-        trainNN(data_train[tmp],desiredOut);
-        desiredOut[class_train[tmp]] = 0.1;
+        return 1;
     }
-    printf("TRAINING FINISHED!\n\n");
-
-    for (int i = 0; i < NTRAIN; i++)//test with training set
+    if (allocLayerBuffers(&net,1,layerOut,layerDelta) != 0 || initBatchBuffers(&net) != 0)
+    {
+        return 1;
+    }
+    struct Dataset trainSet, testSet;
+    if (readfile("./DATA/fashion-mnist_train.csv",class_train,&trainSet,NTRAIN) != 0 ||
+        readfile("./DATA/fashion-mnist_test.csv",class_test,&testSet,NTEST) != 0)
+    {
+        printf("Could not load the dataset from ./DATA\n");
+        return 1;
+    }
+    unsigned char *train = NULL, *test = NULL;
+    if (arenaInit(&dataArena,(size_t)(NTRAIN + NTEST) * DATA_STRIDE,ARENA_HUGE_PAGES) == 0)
+    {
+        train = stageDataset(&trainSet,&dataArena);
+        test = stageDataset(&testSet,&dataArena);
+    }
+    if (train == NULL || test == NULL)
     {
-        activateNN(data_train[i]);
-        evaluate(class_train[i],confusionMatrixTrain);
+        printf("Could not allocate the images\n");
+        return 1;
+    }
+    data_train = (const unsigned char (*)[DATA_STRIDE])train;
+    data_test = (const unsigned char (*)[DATA_STRIDE])test;
+    double throughput = 0;
+    if (!pretrained)//a loaded model comes with the statistics it was trained with
+    {
+        computeStats(&trainSet,&stats_train);
+        if (initVecs(&net) != 0)//initialise weights
+        {
+            printf("Could not initialise the weights\n");
+            return 1;
+        }
+        if (BENCH_SAMPLES > 0)
+        {
+            benchmarkTraining(BENCH_SAMPLES);
+        }
+        throughput = trainEpochs(ITERATIONS,TRAIN_MODE);//train the nn
+        printf("TRAINING FINISHED!\n\n");
+        saveModel(&net,&stats_train,MODEL_PATH);
     }
 
-    for (int i = 0; i < NTEST; i++)//test with testing set
+    if (inferBatch(&net,data_train,&stats_train,NTRAIN,NULL,class_train,confusionMatrixTrain) != 0 ||//test with training set
+        inferBatch(&net,data_test,&stats_train,NTEST,NULL,class_test,confusionMatrixTest) != 0)//test with testing set
     {
-        activateNN(data_test[i]);
-        evaluate(class_test[i],confusionMatrixTest);
+        printf("Could not allocate the inference buffers\n");
+        return 1;
     }
     double register testCorrect = 0;
     double register trainCorrect = 0;
-    for (int i = 0; i < NL2; i++)
+    for (int i = 0; i < NCLASSES; i++)
     {
         testCorrect += confusionMatrixTest[i][i];
         trainCorrect += confusionMatrixTrain[i][i];
@@ -238,7 +570,88 @@ int main() {
     printf("Correct rate in training samples: %0.3f\n",trainCorrect);
     printf("Correct rate in testing samples: %0.3f\n",testCorrect);
     printf("Overall hit rate: %0.3f\n",totalCorrect);
-    printf("Learning rate = %0.4f\n",ALPHA);
-    printf("EPOCHS = %d\n",(int)ITERATIONS);
+    printf("Topology = ");
+    printNetwork(&net);
+    printf("Precision = %s\n",PRECISION_NAME);
+    if (pretrained)
+    {
+        printf("Model loaded from %s\n",arg);
+    }
+    else
+    {
+        printf("Learning rate = %0.4f\n",ALPHA);
+        printf("EPOCHS = %d\n",(int)ITERATIONS);
+        printf("Training mode = %s\n",TRAIN_MODE == MODE_SAMPLE ? "per-sample" : TRAIN_MODE == MODE_BATCH ? "mini-batch" :
+            TRAIN_MODE == MODE_HOGWILD ? "hogwild" : "distributed");
+        printf("Batch size = %d\n",BATCH_SIZE);
+        printf("Training throughput: %.0f samples/s\n",throughput);
+        printf("Model saved to %s, epochs logged to %s\n",MODEL_PATH,EPOCH_LOG);
+    }
+    if (benchmarkInference(&net,data_test,&stats_train,NTEST) != 0)
+    {
+        printf("Could not allocate the inference buffers, the inference benchmark is skipped\n");
+    }
+
+    // int8 quantised inference, compared with the floating point network
+    struct QNetwork qnet;
+    double confusionMatrixQuant[NCLASSES][NCLASSES] = {0};
+    int quantOk = quantizeNetwork(&qnet,&net) == 0;
+    quantOk = quantOk && calibrateNetwork(&qnet,&net,data_train,&stats_train,NTRAIN,CALIB_SAMPLES) == 0;
+    double start = omp_get_wtime();
+    quantOk = quantOk && inferQuantised(&qnet,data_test,&stats_train,NTEST,NULL,class_test,confusionMatrixQuant) == 0;
+    double quantThroughput = NTEST / (omp_get_wtime() - start);
+    start = omp_get_wtime();
+    for (int i = 0; i < NTEST; i++)
+    {
+        normalizeInput(data_test[i],&stats_train,input);
+        activateNN(input);
+    }
+    double fpThroughput = NTEST / (omp_get_wtime() - start);
+    if (quantOk)
+    {
+        double register quantCorrect = 0;
+        for (int i = 0; i < NCLASSES; i++)
+        {
+            quantCorrect += confusionMatrixQuant[i][i];
+        }
+        quantCorrect /= (double)NTEST;
+        printf("int8 inference: testing hit rate %0.3f (%+0.3f), %.0f samples/s, %.1fx the speed of activateNN (%.0f samples/s)\n",
+               quantCorrect,quantCorrect - testCorrect,quantThroughput,quantThroughput / fpThroughput,fpThroughput);
+    }
+    else
+    {
+        printf("Could not allocate the quantised network buffers, the int8 inference benchmark is skipped\n");
+    }
+    // the same per-sample inference on the nonzero pixels only
+    struct SparseSample *sp = NULL;
+    if (SPARSE_INPUT)
+    {
+        sp = malloc(sizeof(struct SparseSample));
+        if (sp == NULL || foldInputLayer(&net,&stats_train) != 0)
+        {
+            printf("Could not fold the first layer, the sparse inference benchmark is skipped\n");
+            free(sp);
+            sp = NULL;
+        }
+    }
+    if (sp != NULL)
+    {
+        long nnz = 0, sparseCorrect = 0;
+        start = omp_get_wtime();
+        for (int i = 0; i < NTEST; i++)
+        {
+            sparseInput(data_test[i],&stats_train,sp);
+            activateSparseNN(sp);
+            nnz += sp->nnz;
+            sparseCorrect += argmaxClass(layerOut[net.nlayers-1]) == class_test[i];
+        }
+        double sparseThroughput = NTEST / (omp_get_wtime() - start);
+        printf("Sparse first layer: testing hit rate %0.3f, %.0f samples/s, %.1fx the speed of activateNN (%.0f%% nonzero pixels)\n",
+               (double)sparseCorrect / NTEST,sparseThroughput,sparseThroughput / fpThroughput,100.0 * nnz / ((double)NTEST * NINPUT));
+        free(sp);
+    }
+    freeQNetwork(&qnet);
+    poolStop();
+    arenaFree(&dataArena);
     return 0;
 }
\ No newline at end of file
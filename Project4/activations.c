@@ -0,0 +1,211 @@
+/*
+    Activation functions and loss of the neural network.
+
+    exp() is replaced by fastExp(): a Cody-Waite range reduction
+    x = n*ln2 + r, |r| <= ln2/2, followed by a Taylor polynomial for e^r and an
+    exponent-bit scaling by 2^n. It only uses arithmetic and integer bit
+    operations, so the compiler vectorises every "#pragma omp simd" loop that
+    calls it. The polynomial degree is picked for the precision in use:
+      float   degree 6,  relative error < 3e-7 (about 2 ulp)
+      double  degree 11, relative error < 1e-14
+    and the input is clamped so that the result never overflows.
+
+    Supported activations: logistic, relu, leaky_relu and softmax (output layer
+    only). A softmax output layer is trained with cross-entropy, whose gradient
+    with respect to the logits is simply p - y, so the softmax Jacobian is never
+    formed. Every other output layer is trained with the original MSE loss and
+    0.9/0.1 targets.
+*/
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+// **********************************************************
+// DEFINITIONS
+#define ACT_LOGISTIC 0
+#define ACT_RELU 1
+#define ACT_LEAKY_RELU 2
+#define ACT_SOFTMAX 3
+#define N_ACTIVATIONS 4
+#define LEAKY_SLOPE (nn_real)0.01 // slope of leaky ReLU for negative inputs
+
+#define LN2_HI (nn_real)0.693145751953125        // ln2 split in two parts so that
+#define LN2_LO (nn_real)1.42860682030941723212e-6 // n*LN2_HI is exact
+#define LOG2E (nn_real)1.44269504088896340736
+#if PRECISION == PREC_DOUBLE
+#define EXP_LIMIT 708.0
+#define EXP_DEGREE 11
+#define ROUND_MAGIC 6755399441055744.0 // 1.5 * 2^52
+#else
+#define EXP_LIMIT 87.0f
+#define EXP_DEGREE 6
+#define ROUND_MAGIC 12582912.0f // 1.5 * 2^23
+#endif
+
+const char *activationNames[N_ACTIVATIONS] = {"logistic", "relu", "leaky_relu", "softmax"};
+
+// **********************************************************
+// Returns the activation with the given name, or -1.
+int activationFromName(const char *name) {
+    for (int a = 0; a < N_ACTIVATIONS; a++) {
+        if (strcmp(name, activationNames[a]) == 0)
+            return a;
+    }
+    return -1;
+}
+
+// **********************************************************
+// Vectorisable e^x, see the description at the top of the file.
+static inline nn_real fastExp(nn_real x) {
+    x = x > EXP_LIMIT ? EXP_LIMIT : x;
+    x = x < -EXP_LIMIT ? -EXP_LIMIT : x;
+    // n = round(x / ln2), computed with the magic number trick so that its
+    // integer value is available in the low bits of nf
+    nn_real nf = x * LOG2E + ROUND_MAGIC;
+    nn_real n = nf - ROUND_MAGIC;
+    nn_real r = (x - n * LN2_HI) - n * LN2_LO;
+    // Taylor polynomial of e^r in Horner form
+    nn_real p = 1;
+    for (int k = EXP_DEGREE; k > 0; k--) {
+        p = 1 + p * r * ((nn_real)1 / k);
+    }
+    // multiply by 2^n by building its exponent bits
+#if PRECISION == PREC_DOUBLE
+    uint64_t bits;
+    memcpy(&bits, &nf, sizeof(bits));
+    bits = (bits + 1023) << 52;
+    double scale;
+#else
+    uint32_t bits;
+    memcpy(&bits, &nf, sizeof(bits));
+    bits = (bits + 127) << 23;
+    float scale;
+#endif
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// **********************************************************
+// Implements the logistic sigmoid function.
+static inline nn_real logistic(nn_real x) {
+    return 1 / (1 + fastExp(-x));
+}
+
+// **********************************************************
+// Applies an element-wise activation to one neuron's input.
+// Softmax is not element-wise and is applied by softmaxArray instead.
+static inline nn_real activate(int act, nn_real x) {
+    if (act == ACT_RELU)
+        return x > 0 ? x : 0;
+    if (act == ACT_LEAKY_RELU)
+        return x > 0 ? x : LEAKY_SLOPE * x;
+    if (act == ACT_SOFTMAX)
+        return x;
+    return logistic(x);
+}
+
+// **********************************************************
+// Replaces the n values of z by their softmax.
+static inline void softmaxArray(nn_real *z, int n) {
+    nn_real max = z[0];
+    for (int i = 1; i < n; i++) {
+        max = z[i] > max ? z[i] : max;
+    }
+    nn_real sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (int i = 0; i < n; i++) {
+        z[i] = fastExp(z[i] - max);
+        sum += z[i];
+    }
+    nn_real register inv = 1 / sum;
+    #pragma omp simd
+    for (int i = 0; i < n; i++) {
+        z[i] *= inv;
+    }
+}
+
+// **********************************************************
+// Applies an activation to the n neuron inputs in z, in place.
+static inline void activateArray(int act, nn_real *z, int n) {
+    switch (act) {
+    case ACT_RELU:
+        #pragma omp simd
+        for (int i = 0; i < n; i++) {
+            z[i] = z[i] > 0 ? z[i] : 0;
+        }
+        break;
+    case ACT_LEAKY_RELU:
+        #pragma omp simd
+        for (int i = 0; i < n; i++) {
+            z[i] = z[i] > 0 ? z[i] : LEAKY_SLOPE * z[i];
+        }
+        break;
+    case ACT_SOFTMAX:
+        softmaxArray(z, n);
+        break;
+    default:
+        #pragma omp simd
+        for (int i = 0; i < n; i++) {
+            z[i] = 1 / (1 + fastExp(-z[i]));
+        }
+    }
+}
+
+// **********************************************************
+// Multiplies the n back-propagated deltas by the derivative of the activation,
+// which is expressed through the activation's outputs.
+static inline void multiplyDerivative(int act, const nn_real *out, nn_real *delta, int n) {
+    switch (act) {
+    case ACT_RELU:
+        #pragma omp simd
+        for (int i = 0; i < n; i++) {
+            delta[i] = out[i] > 0 ? delta[i] : 0;
+        }
+        break;
+    case ACT_LEAKY_RELU:
+        #pragma omp simd
+        for (int i = 0; i < n; i++) {
+            delta[i] = out[i] > 0 ? delta[i] : LEAKY_SLOPE * delta[i];
+        }
+        break;
+    default:
+        #pragma omp simd
+        for (int i = 0; i < n; i++) {
+            delta[i] *= out[i] * (1 - out[i]);
+        }
+    }
+}
+
+// **********************************************************
+// Derivative of an element-wise activation, expressed through its output.
+static inline nn_real activateDerivative(int act, nn_real out) {
+    if (act == ACT_RELU)
+        return out > 0 ? 1 : 0;
+    if (act == ACT_LEAKY_RELU)
+        return out > 0 ? 1 : LEAKY_SLOPE;
+    return out * (1 - out);
+}
+
+// **********************************************************
+// Computes the deltas of an output layer with activation act, given its
+// NCLASSES outputs and the correct class, and returns the sample's loss.
+// Softmax outputs use cross-entropy (delta = p - y), every other activation
+// the MSE against 0.9/0.1 targets.
+static inline nn_real outputDelta(int act, const nn_real *out, int inputClass, nn_real *delta) {
+    nn_real loss = 0;
+    if (act == ACT_SOFTMAX) {
+        for (int i = 0; i < NCLASSES; i++) {
+            delta[i] = out[i] - (i == inputClass);
+        }
+        loss = -log(out[inputClass] > (nn_real)1e-30 ? out[inputClass] : (nn_real)1e-30);
+    }
+    else {
+        for (int i = 0; i < NCLASSES; i++) {
+            nn_real register target = (i == inputClass) ? (nn_real)0.9 : (nn_real)0.1;
+            nn_real register err = out[i] - target;
+            loss += err * err / 2;
+            delta[i] = err;
+        }
+        multiplyDerivative(act, out, delta, NCLASSES);
+    }
+    return loss;
+}
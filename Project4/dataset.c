@@ -0,0 +1,404 @@
+/*
+    Loading of the MNIST fashion dataset.
+
+    The first time a CSV file is loaded it is mmap'd and parsed in parallel:
+    the file is split into one chunk per thread at line boundaries and every
+    thread parses its own lines with a small integer parser (the pixels are
+    0-255 integers, so there is no need for atof). While parsing, every thread
+    also accumulates the per-feature sums and sums of squares of its rows. The
+    result is written next to the CSV as a compact binary cache ("<file>.u8"):
+
+        header (64 bytes) | labels (count bytes, padded to 64) | pixels (count x dim bytes)
+        | feature sums (dim x uint64) | feature sums of squares (dim x uint64)
+
+    Later runs mmap the cache directly, so loading costs only the page faults
+    of the data that is actually read. The pixels are then staged once into
+    padded, cache-line aligned rows of a huge-page arena (stageDataset), since
+    training gathers them row by row in random order.
+    The pixels are used as raw bytes and normalised when they are fed to the
+    network (normalizeInput), so the normalisation statistics are all that is
+    needed, and they come straight from the stored sums. The sums are integers,
+    so mean and variance are exact and need no second pass.
+*/
+#include <fcntl.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// **********************************************************
+// DEFINITIONS
+#define CACHE_MAGIC "FMU8"
+#define CACHE_VERSION 2
+#define CACHE_ALIGN 64
+#define STATS_BLOCK 1024 // rows summed in 32-bit counters by computeStats
+// **********************************************************
+// STRUCTS
+struct DatasetHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t count; // number of examples
+    uint32_t dim;   // pixels per example
+    char pad[CACHE_ALIGN - 16];
+};
+
+// Per-feature statistics used to normalise the raw pixels.
+struct FeatureStats {
+    nn_real mean[NINPUT];
+    nn_real invStddev[NINPUT];
+};
+
+// A dataset that lives in a read-only mapping of its cache file.
+struct Dataset {
+    int count;
+    int dim;
+    const unsigned char *labels; // count labels
+    const unsigned char *pixels; // count x dim pixels, row-major
+    const uint64_t *sum;         // per-feature sums over the count examples, or NULL
+    const uint64_t *sumSq;       // per-feature sums of squares, or NULL
+    void *map;
+    size_t mapSize;
+};
+
+// **********************************************************
+// Size of the labels block in a cache file.
+size_t cacheLabelsSize(int count) {
+    return ((size_t)count + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+// **********************************************************
+// Size of a cache file of count examples.
+size_t cacheSize(int count) {
+    return sizeof(struct DatasetHeader) + cacheLabelsSize(count) + (size_t)count * NINPUT + 2 * NINPUT * sizeof(uint64_t);
+}
+
+// **********************************************************
+// Maps a cache file and checks that it holds at least numVectors examples
+// of NINPUT pixels. Returns 0 on success.
+int mapCache(const char *cachePath, int numVectors, struct Dataset *ds) {
+    int fd = open(cachePath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct DatasetHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    const struct DatasetHeader *h = map;
+    if (memcmp(h->magic, CACHE_MAGIC, 4) != 0 || h->version != CACHE_VERSION || h->dim != NINPUT ||
+        h->count < (uint32_t)numVectors || (size_t)st.st_size < cacheSize(h->count)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    ds->count = numVectors;
+    ds->dim = h->dim;
+    ds->labels = (const unsigned char *)map + sizeof(struct DatasetHeader);
+    ds->pixels = ds->labels + cacheLabelsSize(h->count);
+    // the stored sums only describe the dataset if all of it is used
+    ds->sum = h->count == (uint32_t)numVectors ? (const uint64_t *)(ds->pixels + (size_t)h->count * NINPUT) : NULL;
+    ds->sumSq = ds->sum != NULL ? ds->sum + NINPUT : NULL;
+    ds->map = map;
+    ds->mapSize = st.st_size;
+    return 0;
+}
+
+// **********************************************************
+// Parses a non-negative decimal integer starting at *p and advances *p past it.
+static inline int parseUint(const char **p, const char *end) {
+    const char *s = *p;
+    int v = 0;
+    while (s < end && (unsigned)(*s - '0') < 10) {
+        v = v * 10 + (*s - '0');
+        s++;
+    }
+    *p = s;
+    return v;
+}
+
+// **********************************************************
+// Parses numVectors CSV lines of "label,p1,...,pNINPUT" (after a header line)
+// in parallel, and adds the per-feature sums and sums of squares of the pixels
+// to sum and sumSq. Returns 0 on success, -1 if out of memory, -2 if the file
+// has too few lines and -3 if a line is malformed.
+int parseCSV(const char *buf, size_t size, int numVectors, unsigned char *labels, unsigned char *pixels,
+             uint64_t *sum, uint64_t *sumSq) {
+    const char *end = buf + size;
+    const char *body = memchr(buf, '\n', size); // skip the header line
+    if (body == NULL)
+        return -2;
+    body++;
+    int nThreads = omp_get_max_threads();
+    int *lineCount = calloc(nThreads + 1, sizeof(int));
+    int status = 0;
+    if (lineCount == NULL)
+        return -1;
+
+    #pragma omp parallel num_threads(nThreads)
+    {
+        // Each thread owns the lines that start inside its chunk of the file.
+        int t = omp_get_thread_num();
+        size_t len = end - body;
+        const char *from = body + len * t / nThreads;
+        const char *to = body + len * (t + 1) / nThreads;
+        if (t > 0) {
+            const char *nl = memchr(from - 1, '\n', end - from + 1);
+            from = nl ? nl + 1 : end;
+        }
+        if (t < nThreads - 1) {
+            const char *nl = memchr(to - 1, '\n', end - to + 1);
+            to = nl ? nl + 1 : end;
+        }
+        int lines = 0;
+        for (const char *p = from; p < to; lines++) {
+            const char *nl = memchr(p, '\n', to - p);
+            p = nl ? nl + 1 : to;
+        }
+        lineCount[t + 1] = lines;
+        #pragma omp barrier
+        #pragma omp single
+        for (int i = 0; i < nThreads; i++) {
+            lineCount[i + 1] += lineCount[i];
+        }
+        // Parse this thread's lines into their final rows.
+        uint64_t localSum[NINPUT] = {0}, localSumSq[NINPUT] = {0};
+        int row = lineCount[t];
+        for (const char *p = from; p < to && row < numVectors; row++) {
+            const char *labelStart = p;
+            int label = parseUint(&p, to);
+            if (p == labelStart || p >= to || *p != ',' || label > 255) {
+                #pragma omp atomic write
+                status = -3;
+                break;
+            }
+            labels[row] = label;
+            unsigned char *px = pixels + (size_t)row * NINPUT;
+            for (int i = 0; i < NINPUT; i++) {
+                p++; // skip the separator
+                const char *start = p;
+                int v = parseUint(&p, to);
+                // a line ends after its last pixel only, a short line must not run into the next one
+                int sepOk = i < NINPUT - 1 ? p < to && *p == ',' : p == to || *p == '\n' || *p == '\r';
+                if (p == start || v > 255 || !sepOk) {
+                    #pragma omp atomic write
+                    status = -3;
+                    break;
+                }
+                px[i] = v;
+                localSum[i] += v;
+                localSumSq[i] += v * v;
+            }
+            const char *nl = memchr(p, '\n', to - p);
+            p = nl ? nl + 1 : to;
+        }
+        #pragma omp critical
+        for (int i = 0; i < NINPUT; i++) {
+            sum[i] += localSum[i];
+            sumSq[i] += localSumSq[i];
+        }
+    }
+    if (status == 0 && lineCount[nThreads] < numVectors)
+        status = -2;
+    free(lineCount);
+    return status;
+}
+
+// **********************************************************
+// Opens the temporary file path.tmp (written to tmpPath) for writing. The data
+// only replaces path once commitTempFile succeeds, so a crash never leaves a
+// truncated file behind.
+FILE *openTempFile(const char *path, char tmpPath[4096]) {
+    snprintf(tmpPath, 4096, "%s.tmp", path);
+    return fopen(tmpPath, "wb");
+}
+
+// **********************************************************
+// Closes a file opened with openTempFile and, if ok (every write succeeded),
+// renames it to path. Otherwise the temporary file is removed. Returns 0 on
+// success, -1 on failure.
+int commitTempFile(FILE *fp, int ok, const char *tmpPath, const char *path) {
+    if (fp == NULL)
+        return -1;
+    if (fclose(fp) != 0)
+        ok = 0;
+    if (!ok || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+// **********************************************************
+// Parses the CSV file and writes its binary cache. Returns 0 on success.
+int buildCache(const char *csvPath, const char *cachePath, int numVectors) {
+    int fd = open(csvPath, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -2;
+    }
+    const char *csv = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (csv == MAP_FAILED)
+        return -1;
+    madvise((void *)csv, st.st_size, MADV_SEQUENTIAL);
+
+    size_t size = cacheSize(numVectors);
+    unsigned char *out = calloc(size, 1);
+    if (out == NULL) {
+        munmap((void *)csv, st.st_size);
+        return -1;
+    }
+    struct DatasetHeader *h = (struct DatasetHeader *)out;
+    memcpy(h->magic, CACHE_MAGIC, 4);
+    h->version = CACHE_VERSION;
+    h->count = numVectors;
+    h->dim = NINPUT;
+    unsigned char *labels = out + sizeof(struct DatasetHeader);
+    unsigned char *pixels = labels + cacheLabelsSize(numVectors);
+    uint64_t *sum = (uint64_t *)(pixels + (size_t)numVectors * NINPUT);
+    int status = parseCSV(csv, st.st_size, numVectors, labels, pixels, sum, sum + NINPUT);
+    munmap((void *)csv, st.st_size);
+
+    if (status == 0) {
+        char tmpPath[4096];
+        FILE *fp = openTempFile(cachePath, tmpPath);
+        int ok = fp != NULL && fwrite(out, 1, size, fp) == size;
+        if (commitTempFile(fp, ok, tmpPath, cachePath) != 0)
+            fprintf(stderr, "Could not write dataset cache %s\n", cachePath);
+    }
+    free(out);
+    return status;
+}
+
+// **********************************************************
+// Loads the first numVectors examples of a CSV file through its binary cache,
+// creating or refreshing the cache when needed. Returns 0 on success, -1 if the
+// file cannot be opened, -2 if it has too few lines and -3 if it is malformed.
+int loadDataset(const char *csvPath, int numVectors, struct Dataset *ds) {
+    char cachePath[4096];
+    snprintf(cachePath, sizeof(cachePath), "%s.u8", csvPath);
+    struct stat csvSt, cacheSt;
+    int haveCsv = stat(csvPath, &csvSt) == 0;
+    int cacheFresh = stat(cachePath, &cacheSt) == 0 && (!haveCsv || cacheSt.st_mtime >= csvSt.st_mtime);
+    if (cacheFresh && mapCache(cachePath, numVectors, ds) == 0)
+        return 0;
+    if (!haveCsv)
+        return -1;
+    int status = buildCache(csvPath, cachePath, numVectors);
+    if (status != 0)
+        return status;
+    return mapCache(cachePath, numVectors, ds) == 0 ? 0 : -1;
+}
+
+// **********************************************************
+// Computes the per-feature mean and inverse standard deviation from the sums
+// and sums of squares of n examples. Constant features get an inverse
+// standard deviation of 0, so they are normalised to 0.
+void statsFromSums(const uint64_t *sum, const uint64_t *sumSq, int n, struct FeatureStats *stats) {
+    for (int i = 0; i < NINPUT; i++) {
+        // n * sumSq - sum^2 is exact in 64 bits for up to 16 million examples
+        uint64_t num = (uint64_t)n * sumSq[i] - sum[i] * sum[i];
+        double var = (double)num / ((double)n * (n - 1));
+        stats->mean[i] = (double)sum[i] / n;
+        stats->invStddev[i] = var > 0 ? 1 / sqrt(var) : 0;
+    }
+}
+
+// **********************************************************
+// Computes the normalisation statistics of a dataset. They come from the sums
+// stored in its cache when it has them, otherwise the pixels are read once,
+// row by row, by all threads. Each thread sums blocks of STATS_BLOCK rows in
+// 32-bit counters, which vectorise better than 64-bit ones and cannot
+// overflow within a block, and then adds them to 64-bit totals.
+void computeStats(const struct Dataset *ds, struct FeatureStats *stats) {
+    if (ds->sum != NULL) {
+        statsFromSums(ds->sum, ds->sumSq, ds->count, stats);
+        return;
+    }
+    uint64_t sum[NINPUT] = {0}, sumSq[NINPUT] = {0};
+    #pragma omp parallel
+    {
+        uint64_t localSum[NINPUT] = {0}, localSumSq[NINPUT] = {0};
+        uint32_t blockSum[NINPUT], blockSumSq[NINPUT];
+        #pragma omp for schedule(static)
+        for (int b0 = 0; b0 < ds->count; b0 += STATS_BLOCK) {
+            memset(blockSum, 0, sizeof(blockSum));
+            memset(blockSumSq, 0, sizeof(blockSumSq));
+            int b1 = b0 + STATS_BLOCK < ds->count ? b0 + STATS_BLOCK : ds->count;
+            for (int j = b0; j < b1; j++) {
+                const unsigned char *px = ds->pixels + (size_t)j * NINPUT;
+                #pragma omp simd
+                for (int i = 0; i < NINPUT; i++) {
+                    blockSum[i] += px[i];
+                    blockSumSq[i] += (uint32_t)px[i] * px[i];
+                }
+            }
+            for (int i = 0; i < NINPUT; i++) {
+                localSum[i] += blockSum[i];
+                localSumSq[i] += blockSumSq[i];
+            }
+        }
+        #pragma omp critical
+        for (int i = 0; i < NINPUT; i++) {
+            sum[i] += localSum[i];
+            sumSq[i] += localSumSq[i];
+        }
+    }
+    statsFromSums(sum, sumSq, ds->count, stats);
+}
+
+// **********************************************************
+// Unmaps a dataset.
+void freeDataset(struct Dataset *ds) {
+    munmap(ds->map, ds->mapSize);
+    ds->map = NULL;
+}
+
+// **********************************************************
+// Copies the pixels of ds to rows of DATA_STRIDE bytes allocated from arena,
+// so that every row starts on a cache line and the rows that training
+// gathers at random are backed by huge pages when the system has them.
+// Returns the rows, or NULL if the arena is full.
+unsigned char *stageDataset(const struct Dataset *ds, struct Arena *arena) {
+    unsigned char *rows = arenaAlloc(arena, (size_t)ds->count * DATA_STRIDE);
+    if (rows == NULL)
+        return NULL;
+    #pragma omp parallel for schedule(static)
+    for (int j = 0; j < ds->count; j++) {
+        memcpy(rows + (size_t)j * DATA_STRIDE, ds->pixels + (size_t)j * NINPUT, NINPUT);
+    }
+    return rows;
+}
+
+// **********************************************************
+// Used for reading the MNIST fashion dataset. The pixels stay in the read-only
+// mapping of the cache (ds->pixels), only the labels are copied to Class.
+int readfile(char *filepath, int *Class, struct Dataset *ds, int numVectors) {
+    int status = loadDataset(filepath, numVectors, ds);
+    if (status != 0)
+        return status;
+    for (int j = 0; j < numVectors; j++) {
+        Class[j] = ds->labels[j];
+    }
+    printf("Loaded %d examples\n", numVectors);
+    return 0;
+}
+
+// **********************************************************
+// Normalises the raw pixels of one example into out.
+static inline void normalizeInput(const unsigned char *raw, const struct FeatureStats *stats, nn_real *out) {
+    #pragma omp simd
+    for (int i = 0; i < NINPUT; i++) {
+        out[i] = (raw[i] - stats->mean[i]) * stats->invStddev[i];
+    }
+}
@@ -0,0 +1,279 @@
+/*
+    Data-parallel mini-batch training with multiple worker processes.
+
+    trainDistributed() forks nWorkers processes. Each one holds a private copy
+    of the network and trains on its own contiguous shard of the training set.
+    Every step, each worker computes the gradient of its part of the global
+    BATCH_SIZE batch. The workers sum their gradients with an allreduce over
+    a shared memory mapping, and all apply the same averaged update, so their
+    weights stay identical. A step is therefore equivalent to one step of the
+    single-process mini-batch path.
+
+    The allreduce is bucketed by layer and overlapped with the backward pass.
+    As soon as a worker has the gradient of a layer it publishes it in its
+    slot of the shared mapping and goes on back-propagating to the previous
+    layer. In between, it reduces its own segment (1/nWorkers of the values) of
+    every layer that all workers have published (a reduce-scatter). The summed
+    segments are written to a shared buffer, which every worker reads once
+    all layers are reduced. The segments are always summed in worker order,
+    so the result is deterministic.
+
+    Synchronisation uses monotonic counters in the shared mapping (one per
+    layer for publishing and one for reducing), waited on with a short spin
+    followed by sched_yield(). Slots are only overwritten after every worker
+    has finished reading them in the previous step.
+
+    The workers run with one OpenMP thread each, since the processes
+    themselves provide the parallelism.
+*/
+#include <omp.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef NWORKERS
+#define NWORKERS 4 // worker processes of the distributed training mode
+#endif
+#define SPIN_LIMIT 1000 // polls of a counter before yielding the CPU
+// **********************************************************
+// STRUCTS
+// A counter on its own cache line.
+struct SharedCounter {
+    uint64_t value __attribute__((aligned(64)));
+};
+
+// Start of the shared mapping of a distributed training run.
+struct AllreduceCtl {
+    struct SharedCounter published[MAX_LAYERS]; // gradients published, per layer
+    struct SharedCounter reduced[MAX_LAYERS];   // segments reduced, per layer
+    struct SharedCounter failed;                // set by a worker that could not run
+    double loss[NWORKERS];                      // loss summed by each worker over its samples
+};
+
+// Layout of the shared mapping, the same in every worker.
+struct Allreduce {
+    struct AllreduceCtl *ctl;
+    int nWorkers;
+    size_t offset[MAX_LAYERS]; // start of each layer in a gradient buffer, in values
+    size_t size;               // values of a whole gradient buffer
+    nn_real *slots;            // nWorkers gradient buffers
+    nn_real *sum;              // reduced gradient
+    nn_weight *weights;        // final weights, written by worker 0, laid out like the gradients
+    void *map;
+    size_t mapSize;
+};
+
+// **********************************************************
+// Waits until a shared counter reaches target. Returns -1 if the run was
+// aborted in the meantime.
+static inline int waitCounter(struct Allreduce *ar, struct SharedCounter *c, uint64_t target) {
+    int spins = 0;
+    while (__atomic_load_n(&c->value, __ATOMIC_ACQUIRE) < target) {
+        if (__atomic_load_n(&ar->ctl->failed.value, __ATOMIC_ACQUIRE) != 0)
+            return -1;
+        if (++spins > SPIN_LIMIT)
+            sched_yield();
+    }
+    return 0;
+}
+
+// **********************************************************
+// Creates the shared mapping for a network and nWorkers workers.
+// Returns 0 on success.
+int initAllreduce(struct Allreduce *ar, const struct Network *net, int nWorkers) {
+    ar->nWorkers = nWorkers;
+    ar->size = 0;
+    for (int l = 0; l < net->nlayers; l++) {
+        ar->offset[l] = ar->size;
+        ar->size += (size_t)net->layer[l].nout * net->layer[l].ld;
+    }
+    size_t ctlSize = (sizeof(struct AllreduceCtl) + 63) / 64 * 64;
+    size_t gradBytes = (ar->size * sizeof(nn_real) + 63) / 64 * 64;
+    size_t weightBytes = (ar->size * sizeof(nn_weight) + 63) / 64 * 64;
+    ar->mapSize = ctlSize + (nWorkers + 1) * gradBytes + weightBytes;
+    ar->map = mmap(NULL, ar->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ar->map == MAP_FAILED)
+        return -1;
+    ar->ctl = ar->map;
+    ar->slots = (nn_real *)((char *)ar->map + ctlSize);
+    ar->sum = (nn_real *)((char *)ar->slots + nWorkers * gradBytes);
+    ar->weights = (nn_weight *)((char *)ar->sum + gradBytes);
+    return 0;
+}
+
+// **********************************************************
+// Reduces worker w's segment of layer l into the shared sum.
+void reduceSegment(struct Allreduce *ar, const struct Network *net, int l, int w) {
+    size_t n = (size_t)net->layer[l].nout * net->layer[l].ld;
+    size_t from = ar->offset[l] + n * w / ar->nWorkers;
+    size_t to = ar->offset[l] + n * (w + 1) / ar->nWorkers;
+    nn_real *sum = ar->sum;
+    #pragma omp simd
+    for (size_t j = from; j < to; j++) {
+        sum[j] = ar->slots[j];
+    }
+    for (int k = 1; k < ar->nWorkers; k++) {
+        const nn_real *slot = ar->slots + k * ar->size;
+        #pragma omp simd
+        for (size_t j = from; j < to; j++) {
+            sum[j] += slot[j];
+        }
+    }
+}
+
+// **********************************************************
+// Reduces this worker's segment of the layers, from *next down to layer 0,
+// that every worker has published in the given step. When block is 0 it
+// returns at the first layer that is not ready yet. Returns -1 if the run was
+// aborted.
+int progressAllreduce(struct Allreduce *ar, const struct Network *net, int w, long step, int *next, int block) {
+    uint64_t target = (uint64_t)ar->nWorkers * (step + 1);
+    while (*next >= 0) {
+        struct SharedCounter *published = &ar->ctl->published[*next];
+        if (!block && __atomic_load_n(&published->value, __ATOMIC_ACQUIRE) < target)
+            return 0;
+        if (waitCounter(ar, published, target) != 0)
+            return -1;
+        reduceSegment(ar, net, *next, w);
+        __atomic_add_fetch(&ar->ctl->reduced[*next].value, 1, __ATOMIC_RELEASE);
+        (*next)--;
+    }
+    return 0;
+}
+
+// **********************************************************
+// Training loop of worker w: steps mini-batches of its share of BATCH_SIZE,
+// taken from shuffled epochs over its shard of the training set.
+// Returns 0 on success.
+int distributedWorker(struct Allreduce *ar, int w, long steps, unsigned int firstStep) {
+    int nWorkers = ar->nWorkers;
+    int bs = BATCH_SIZE / nWorkers + (w < BATCH_SIZE % nWorkers);
+    int shardBegin = (long)NTRAIN * w / nWorkers;
+    int shardSize = (long)NTRAIN * (w + 1) / nWorkers - shardBegin;
+    nn_real *slot = ar->slots + w * ar->size;
+    nn_real register lr = BATCH_ALPHA / BATCH_SIZE;
+    int last = net.nlayers - 1;
+    struct Prefetcher pipe;
+    const nn_real *X;
+    const int *classes;
+    double loss = 0;
+    omp_set_num_threads(1);
+    if (startPrefetcher(&pipe, data_train + shardBegin, class_train + shardBegin, &stats_train, shardSize, bs,
+                        steps * bs, STREAM_DISTRIBUTED + (uint64_t)firstStep * NWORKERS + w, 0) != 0)
+        return -1;
+
+    for (long step = 0; step < steps; step++) {
+        nextBatch(&pipe, &X, &classes);
+        #pragma omp parallel
+        {
+            for (int l = 0; l <= last; l++) {
+                batchForward(&net.layer[l], l == 0 ? X : batchOut[l - 1], batchOut[l], bs);
+            }
+            #pragma omp for schedule(static) reduction(+:loss)
+            for (int b = 0; b < bs; b++) {
+                loss += outputDelta(net.layer[last].act, batchOut[last] + b * NCLASSES, classes[b],
+                                    batchDelta[last] + b * NCLASSES);
+            }
+        }
+        // Backward pass, publishing every layer's gradient as soon as it is ready
+        int next = last;
+        for (int l = last; l >= 0; l--) {
+            #pragma omp parallel
+            batchGradient(&net.layer[l], l == 0 ? X : batchOut[l - 1], batchDelta[l], bs, slot + ar->offset[l]);
+            __atomic_add_fetch(&ar->ctl->published[l].value, 1, __ATOMIC_RELEASE);
+            if (progressAllreduce(ar, &net, w, step, &next, 0) != 0)
+                return -1;
+            if (l > 0) {
+                #pragma omp parallel
+                batchBackward(&net.layer[l], net.layer[l - 1].act, batchDelta[l], batchOut[l - 1], batchDelta[l - 1], bs);
+            }
+        }
+        if (progressAllreduce(ar, &net, w, step, &next, 1) != 0)
+            return -1;
+        // Apply the summed gradient once every segment is reduced
+        unsigned int salt = firstStep + step;
+        for (int l = 0; l <= last; l++) {
+            struct Layer *L = &net.layer[l];
+            if (waitCounter(ar, &ar->ctl->reduced[l], (uint64_t)nWorkers * (step + 1)) != 0)
+                return -1;
+            for (int i = 0; i < L->nout; i++) {
+                nn_weight *wr = L->W + (size_t)i * L->ld;
+                const nn_real *g = ar->sum + ar->offset[l] + (size_t)i * L->ld;
+                L->k.updateRow(wr, -lr, g, rowSalt(salt, l, i), L->nin);
+                STOREW(wr[L->nin], LOADW(wr[L->nin]) - lr * g[L->nin], rowSalt(salt, l, i) + L->nin);
+            }
+        }
+    }
+    stopPrefetcher(&pipe);
+    ar->ctl->loss[w] = loss;
+    if (w == 0) {
+        for (int l = 0; l <= last; l++) {
+            const struct Layer *L = &net.layer[l];
+            memcpy(ar->weights + ar->offset[l], L->W, (size_t)L->nout * L->ld * sizeof(nn_weight));
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Trains the network on numSamples samples, in mini-batches of BATCH_SIZE
+// split across nWorkers (at most NWORKERS) worker processes. Returns 0 on success.
+int trainDistributed(long numSamples, int nWorkers) {
+    struct Allreduce ar;
+    if (nWorkers > NWORKERS)
+        nWorkers = NWORKERS;
+    if (nWorkers > BATCH_SIZE)
+        nWorkers = BATCH_SIZE;
+    if (initAllreduce(&ar, &net, nWorkers) != 0) {
+        printf("Could not create the shared memory of the workers\n");
+        return -1;
+    }
+    long steps = numSamples / BATCH_SIZE;
+    unsigned int firstStep = updateStep + 1;
+    fflush(stdout);
+    int failed = 0;
+    for (int w = 0; w < nWorkers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (distributedWorker(&ar, w, steps, firstStep) == 0)
+                _exit(0);
+            __atomic_store_n(&ar.ctl->failed.value, 1, __ATOMIC_RELEASE); // release the other workers
+            _exit(1);
+        }
+        if (pid < 0) {
+            // the running workers would wait forever for the missing one
+            printf("Could not start worker %d\n", w);
+            failed = 1;
+            __atomic_store_n(&ar.ctl->failed.value, 1, __ATOMIC_RELEASE);
+            nWorkers = w;
+            break;
+        }
+    }
+    for (int w = 0; w < nWorkers; w++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            // also covers a worker killed by a signal, which could not set the flag itself
+            failed = 1;
+            __atomic_store_n(&ar.ctl->failed.value, 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (!failed) {
+        for (int l = 0; l < net.nlayers; l++) {
+            const struct Layer *L = &net.layer[l];
+            memcpy(L->W, ar.weights + ar.offset[l], (size_t)L->nout * L->ld * sizeof(nn_weight));
+        }
+        updateStep += steps;
+        for (int w = 0; w < nWorkers; w++) {
+            lossSum += ar.ctl->loss[w];
+        }
+        lossCount += steps * BATCH_SIZE;
+    }
+    munmap(ar.map, ar.mapSize);
+    return failed ? -1 : 0;
+}
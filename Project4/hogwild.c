@@ -0,0 +1,211 @@
+/*
+    Hogwild!-style asynchronous SGD.
+
+    Instead of parallelising inside the layers of a single sample, every thread
+    picks its own training samples and runs forward/backward passes on private
+    activation and delta buffers. The resulting updates are written to the
+    shared weights without any locking: each sample only moves the weights by a
+    small amount, so the occasional lost update between threads does not hurt
+    convergence (Niu et al., "Hogwild!", 2011).
+
+    With HOGWILD_MERGE_EVERY > 1 each thread instead accumulates its gradients
+    in a private buffer and merges them into the shared weights (still without
+    locks) every HOGWILD_MERGE_EVERY samples, which trades some staleness for
+    far less cache-line traffic on the shared weights.
+*/
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef HOGWILD_MERGE_EVERY
+#define HOGWILD_MERGE_EVERY 1 // samples per merge of the private gradients, 1 = update shared weights directly
+#endif
+// **********************************************************
+// STRUCTS
+// Per-thread input, activations and deltas of one sample.
+struct NNScratch {
+    nn_real in[NINPUT] __attribute__((aligned(64)));
+    nn_real *out[MAX_LAYERS];
+    nn_real *delta[MAX_LAYERS];
+};
+
+// **********************************************************
+// Allocates the scratch buffers of one thread. Returns NULL on failure.
+struct NNScratch *allocScratch(const struct Network *net) {
+    struct NNScratch *s = aligned_alloc(64, sizeof(struct NNScratch));
+    if (s == NULL)
+        return NULL;
+    if (allocLayerBuffers(net, 1, s->out, s->delta) != 0) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// **********************************************************
+// Frees the scratch buffers of one thread.
+void freeScratch(const struct Network *net, struct NNScratch *s) {
+    if (s == NULL)
+        return;
+    for (int l = 0; l < net->nlayers; l++) {
+        free(s->out[l]);
+        free(s->delta[l]);
+    }
+    free(s);
+}
+
+// **********************************************************
+// Runs the forward pass of the network using private buffers.
+void forwardSample(const struct Network *net, const nn_real *in, struct NNScratch *s) {
+    const nn_real *x = in;
+    for (int l = 0; l < net->nlayers; l++) {
+        const struct Layer *L = &net->layer[l];
+        for (int i = 0; i < L->nout; i++) {
+            const nn_weight *w = L->W + (size_t)i * L->ld;
+            s->out[l][i] = L->k.dot(w, x, L->nin) + LOADW(w[L->nin]);
+        }
+        activateArray(L->act, s->out[l], L->nout);
+        x = s->out[l];
+    }
+}
+
+// **********************************************************
+// Computes the deltas of every layer for one sample and returns its loss.
+nn_real backwardSample(const struct Network *net, int inputClass, struct NNScratch *s) {
+    int last = net->nlayers - 1;
+    nn_real loss = outputDelta(net->layer[last].act, s->out[last], inputClass, s->delta[last]);
+    for (int l = last; l > 0; l--) {
+        const struct Layer *L = &net->layer[l];
+        nn_real *dp = s->delta[l - 1];
+        memset(dp, 0, L->nin * sizeof(nn_real));
+        for (int i = 0; i < L->nout; i++) {
+            L->k.axpyWeights(dp, s->delta[l][i], L->W + (size_t)i * L->ld, L->nin);
+        }
+        multiplyDerivative(net->layer[l - 1].act, s->out[l - 1], dp, L->nin);
+    }
+    return loss;
+}
+
+// **********************************************************
+// Applies the update of one sample, scaled by -lr, to the shared weights.
+// step salts the stochastic rounding of bf16 weights.
+void updateSample(struct Network *net, struct NNScratch *s, nn_real lr, unsigned int step) {
+    for (int l = 0; l < net->nlayers; l++) {
+        struct Layer *L = &net->layer[l];
+        const nn_real *x = l == 0 ? s->in : s->out[l - 1];
+        for (int i = 0; i < L->nout; i++) {
+            nn_weight *w = L->W + (size_t)i * L->ld;
+            nn_real register g = -lr * s->delta[l][i];
+            L->k.updateRow(w, g, x, rowSalt(step, l, i), L->nin);
+            STOREW(w[L->nin], LOADW(w[L->nin]) + g, rowSalt(step, l, i) + L->nin);
+        }
+    }
+}
+
+// **********************************************************
+// Same as updateSample, for private gradient buffers laid out like the weights.
+void accumulateSample(const struct Network *net, struct NNScratch *s, nn_real **grad, nn_real lr) {
+    for (int l = 0; l < net->nlayers; l++) {
+        const struct Layer *L = &net->layer[l];
+        const nn_real *x = l == 0 ? s->in : s->out[l - 1];
+        for (int i = 0; i < L->nout; i++) {
+            nn_real *g = grad[l] + (size_t)i * L->ld;
+            nn_real d = -lr * s->delta[l][i];
+            L->k.axpyRows(g, &d, 1, x, 1, L->nin);
+            g[L->nin] += d;
+        }
+    }
+}
+
+// **********************************************************
+// Adds a thread's accumulated gradients to the shared weights without locks
+// and clears them.
+void mergeGradients(struct Network *net, nn_real **grad, unsigned int step) {
+    for (int l = 0; l < net->nlayers; l++) {
+        struct Layer *L = &net->layer[l];
+        for (int i = 0; i < L->nout; i++) {
+            nn_weight *w = L->W + (size_t)i * L->ld;
+            nn_real *g = grad[l] + (size_t)i * L->ld;
+            L->k.updateRow(w, 1, g, rowSalt(step, l, i), L->nin);
+            STOREW(w[L->nin], LOADW(w[L->nin]) + g[L->nin], rowSalt(step, l, i) + L->nin);
+            memset(g, 0, (L->nin + 1) * sizeof(nn_real));
+        }
+    }
+}
+
+// **********************************************************
+// Trains the network on numSamples random samples using nThreads threads
+// that update the shared weights without synchronisation. Sample n is draw n
+// of the run's random stream, so the samples do not depend on the number of
+// threads. Returns 0 on success, -1 if a thread could not allocate its buffers.
+int trainHogwild(long numSamples, int nThreads) {
+    double loss = 0;
+    int failed = 0;
+    uint64_t stream = STREAM_HOGWILD + trainingRuns++;
+    #pragma omp parallel num_threads(nThreads)
+    {
+        struct NNScratch *s = allocScratch(&net);
+        struct Rng rng = rngStream(RNG_SEED, stream);
+        unsigned int step = (1234 + 7919 * omp_get_thread_num()) << 16; // private stochastic rounding salt
+        nn_real register lr = ALPHA;
+        nn_real *grad[MAX_LAYERS] = {NULL};
+        int ok = s != NULL;
+        if (HOGWILD_MERGE_EVERY > 1) {
+            for (int l = 0; l < net.nlayers; l++) {
+                grad[l] = calloc((size_t)net.layer[l].nout * net.layer[l].ld, sizeof(nn_real));
+                ok &= grad[l] != NULL;
+            }
+        }
+        if (!ok) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        // every thread must agree on skipping the loop below
+        #pragma omp barrier
+        int pending = 0;
+        int run;
+        #pragma omp atomic read
+        run = failed;
+        run = !run;
+        PROFILE_START(t);
+
+        if (run) {
+            #pragma omp for schedule(static) reduction(+:loss)
+            for (long n = 0; n < numSamples; n++) {
+                rngSkip(&rng, n - rng.pos); // jump to draw n
+                int register tmp = rngBelow(&rng, NTRAIN);
+                normalizeInput(data_train[tmp], &stats_train, s->in);
+                PROFILE_LAP(t, PHASE_INPUT, 0);
+                forwardSample(&net, s->in, s);
+                PROFILE_LAP(t, PHASE_FORWARD, 0);
+                loss += backwardSample(&net, class_train[tmp], s);
+                PROFILE_LAP(t, PHASE_BACKWARD, 0);
+                step++;
+                if (HOGWILD_MERGE_EVERY > 1) {
+                    accumulateSample(&net, s, grad, lr);
+                    if (++pending == HOGWILD_MERGE_EVERY) {
+                        mergeGradients(&net, grad, step);
+                        pending = 0;
+                    }
+                }
+                else {
+                    updateSample(&net, s, lr, step);
+                }
+                PROFILE_LAP(t, PHASE_UPDATE, 0);
+            }
+        }
+        if (pending > 0) {
+            mergeGradients(&net, grad, step);
+        }
+        for (int l = 0; l < net.nlayers; l++) {
+            free(grad[l]);
+        }
+        freeScratch(&net, s);
+    }
+    if (failed)
+        return -1;
+    lossSum += loss;
+    lossCount += numSamples;
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+    Batched, multithreaded inference.
+
+    inferBatch() classifies a batch of samples and is reentrant: it only reads
+    the network and keeps all its intermediate values in per-thread scratch
+    buffers, so it can be called concurrently on the same trained network.
+    The batch is split in blocks of INFER_BLOCK samples that the threads
+    take dynamically. Every block goes through the layers as a small
+    matrix-matrix product built from the register tiles of the mini-batch
+    path. Each thread fills a private confusion matrix that is merged once at
+    the end.
+
+    benchmarkInference() serves a dataset in batches of INFER_BATCH samples and
+    reports the throughput and the percentiles of the per-batch latency.
+*/
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef INFER_BLOCK
+#define INFER_BLOCK 16 // samples a thread pushes through the network at once, multiple of TILE_SAMPLES
+#endif
+#ifndef INFER_BATCH
+#define INFER_BATCH 256 // samples per request of the inference benchmark
+#endif
+// **********************************************************
+// STRUCTS
+// Per-thread inputs and layer outputs of one block of samples.
+struct InferScratch {
+    nn_real in[INFER_BLOCK][NINPUT] __attribute__((aligned(64)));
+    nn_real *out[MAX_LAYERS]; // INFER_BLOCK x nout outputs of every layer
+};
+
+// **********************************************************
+// Allocates the inference scratch buffers of one thread. Returns NULL if they
+// cannot be allocated.
+struct InferScratch *allocInferScratch(const struct Network *net) {
+    struct InferScratch *s = aligned_alloc(64, sizeof(struct InferScratch));
+    if (s == NULL)
+        return NULL;
+    for (int l = 0; l < net->nlayers; l++) {
+        size_t size = ((size_t)INFER_BLOCK * net->layer[l].nout * sizeof(nn_real) + 63) / 64 * 64;
+        s->out[l] = aligned_alloc(64, size);
+        if (s->out[l] == NULL) {
+            while (--l >= 0) {
+                free(s->out[l]);
+            }
+            free(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+// **********************************************************
+// Frees the inference scratch buffers of one thread.
+void freeInferScratch(const struct Network *net, struct InferScratch *s) {
+    if (s == NULL)
+        return;
+    for (int l = 0; l < net->nlayers; l++) {
+        free(s->out[l]);
+    }
+    free(s);
+}
+
+// **********************************************************
+// Runs the forward pass of n <= INFER_BLOCK samples held in s->in.
+void forwardBlock(const struct Network *net, struct InferScratch *s, int n) {
+    const nn_real *x = &s->in[0][0];
+    for (int l = 0; l < net->nlayers; l++) {
+        const struct Layer *L = &net->layer[l];
+        int rowTiles = (L->nout + TILE_ROWS - 1) / TILE_ROWS;
+        int sampleTiles = (n + TILE_SAMPLES - 1) / TILE_SAMPLES;
+        for (int bt = 0; bt < sampleTiles; bt++) {
+            for (int it = 0; it < rowTiles; it++) {
+                forwardTile(L, x, s->out[l], n, it, bt);
+            }
+        }
+        if (L->act == ACT_SOFTMAX) {
+            for (int b = 0; b < n; b++) {
+                softmaxArray(s->out[l] + (size_t)b * L->nout, L->nout);
+            }
+        }
+        x = s->out[l];
+    }
+}
+
+// **********************************************************
+// Returns the class with the largest output.
+static inline int argmaxClass(const nn_real *out) {
+    int maxIndex = 0;
+    for (int i = 1; i < NCLASSES; i++) {
+        if (out[i] > out[maxIndex])
+            maxIndex = i;
+    }
+    return maxIndex;
+}
+
+// **********************************************************
+// Updates the confusion matrix with the prediction for an output vector.
+// Edge case where both the correct output and another one have the same
+// value, we consider that a correct classification.
+static inline void evaluateOutput(const nn_real *out, int inputClass, double confMatrix[NCLASSES][NCLASSES]) {
+    int maxIndex = argmaxClass(out);
+    if (out[maxIndex] == out[inputClass])
+        maxIndex = inputClass;
+    confMatrix[maxIndex][inputClass]++;
+}
+
+// **********************************************************
+// Classifies the count samples of data (normalised with stats) in parallel.
+// The predicted classes are written to predictions when it is not NULL. When
+// labels is not NULL, the results are also added to confMatrix. Returns 0 on
+// success, -1 if a thread could not allocate its scratch buffers.
+int inferBatch(const struct Network *net, const unsigned char data[][DATA_STRIDE], const struct FeatureStats *stats,
+               int count, int *predictions, const int *labels, double confMatrix[NCLASSES][NCLASSES]) {
+    int nBlocks = (count + INFER_BLOCK - 1) / INFER_BLOCK;
+    int last = net->nlayers - 1;
+    int failed = 0;
+    #pragma omp parallel if (nBlocks > 1)
+    {
+        struct InferScratch *s = allocInferScratch(net);
+        double localConf[NCLASSES][NCLASSES] = {{0}};
+        if (s == NULL) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        // every thread must agree on skipping the loop below
+        #pragma omp barrier
+        int run;
+        #pragma omp atomic read
+        run = failed;
+        run = !run;
+
+        if (run) {
+            #pragma omp for schedule(dynamic, 1)
+            for (int blk = 0; blk < nBlocks; blk++) {
+                int first = blk * INFER_BLOCK;
+                int n = count - first < INFER_BLOCK ? count - first : INFER_BLOCK;
+                for (int b = 0; b < n; b++) {
+                    normalizeInput(data[first + b], stats, s->in[b]);
+                }
+                forwardBlock(net, s, n);
+                for (int b = 0; b < n; b++) {
+                    const nn_real *out = s->out[last] + (size_t)b * NCLASSES;
+                    if (predictions != NULL)
+                        predictions[first + b] = argmaxClass(out);
+                    if (labels != NULL)
+                        evaluateOutput(out, labels[first + b], localConf);
+                }
+            }
+        }
+        if (run && labels != NULL) {
+            #pragma omp critical
+            for (int i = 0; i < NCLASSES; i++) {
+                for (int j = 0; j < NCLASSES; j++) {
+                    confMatrix[i][j] += localConf[i][j];
+                }
+            }
+        }
+        freeInferScratch(net, s);
+    }
+    return failed ? -1 : 0;
+}
+
+// **********************************************************
+// Compares two doubles for qsort.
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// **********************************************************
+// Classifies count samples in requests of INFER_BATCH samples and prints the
+// throughput and the per-request latency percentiles. Returns 0 on success,
+// -1 if the buffers cannot be allocated.
+int benchmarkInference(const struct Network *net, const unsigned char data[][DATA_STRIDE], const struct FeatureStats *stats,
+                       int count) {
+    int nBatches = (count + INFER_BATCH - 1) / INFER_BATCH;
+    double *latency = malloc(nBatches * sizeof(double));
+    int *predictions = malloc(count * sizeof(int));
+    if (latency == NULL || predictions == NULL) {
+        free(latency);
+        free(predictions);
+        return -1;
+    }
+    double start = omp_get_wtime();
+    for (int k = 0; k < nBatches; k++) {
+        int first = k * INFER_BATCH;
+        int n = count - first < INFER_BATCH ? count - first : INFER_BATCH;
+        double t = omp_get_wtime();
+        if (inferBatch(net, data + first, stats, n, predictions + first, NULL, NULL) != 0) {
+            free(latency);
+            free(predictions);
+            return -1;
+        }
+        latency[k] = omp_get_wtime() - t;
+    }
+    double elapsed = omp_get_wtime() - start;
+    qsort(latency, nBatches, sizeof(double), compareDoubles);
+    printf("Inference throughput: %.0f samples/s (%d threads)\n", count / elapsed, omp_get_max_threads());
+    printf("Latency per batch of %d: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n", INFER_BATCH,
+           1e3 * latency[nBatches / 2], 1e3 * latency[(int)(nBatches * 0.95)], 1e3 * latency[(int)(nBatches * 0.99)],
+           1e3 * latency[nBatches - 1]);
+    free(latency);
+    free(predictions);
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*
+    Layer stack of the neural network.
+
+    The network is a list of fully connected layers whose sizes and activation
+    functions are given at runtime as a string such as "256:relu,100:logistic,10:logistic"
+    (the input layer is always NINPUT wide and the last layer must have NCLASSES
+    neurons, the activations are listed in activations.c). Each layer stores its weights as a nout x (nin+1) row-major matrix
+    whose last used column is the bias; rows are padded to a multiple of 64 bytes
+    so that every row starts on a cache line.
+
+    All the training and inference paths are built on a handful of row
+    primitives (dot products, a weight row update and two axpy variants). The primitives
+    are compiled once per common layer input width, so their trip counts are
+    compile-time constants and the compiler can fully vectorise and unroll them
+    without remainder loops, exactly as it could with the old fixed-size arrays.
+    Other widths fall back to a generic version. Each layer picks its
+    primitives when the network is built.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+// **********************************************************
+// DEFINITIONS
+#define MAX_LAYERS 8
+// Layer input widths for which the row primitives are specialised.
+#define SPECIALISED_WIDTHS(X) X(784) X(512) X(256) X(128) X(100) X(64) X(32)
+// **********************************************************
+// STRUCTS
+// Row primitives of a layer, n is the layer's input width.
+struct RowKernels {
+    // returns w . x
+    nn_real (*dot)(const nn_weight *w, const nn_real *x, int n);
+    // out[r][c] = w_r . x_c for 2 weight rows and 4 inputs
+    void (*dotTile)(const nn_weight *w0, const nn_weight *w1, const nn_real *x0, const nn_real *x1,
+                    const nn_real *x2, const nn_real *x3, nn_real out[2][4], int n);
+    // w += g * x, with the stochastic rounding salt of the row for bf16 weights
+    void (*updateRow)(nn_weight *w, nn_real g, const nn_real *x, uint32_t salt, int n);
+    // y += g * w
+    void (*axpyWeights)(nn_real *y, nn_real g, const nn_weight *w, int n);
+    // y += sum_b g[b * gstride] * X[b], for rows consecutive inputs X[b] of n values
+    void (*axpyRows)(nn_real *y, const nn_real *g, int gstride, const nn_real *X, int rows, int n);
+};
+
+struct Layer {
+    int nin;             // input width
+    int nout;            // number of neurons
+    int ld;              // row stride of W, in weights
+    int act;             // activation function
+    nn_weight *W;        // nout x ld weights, W[i*ld + nin] is the bias of neuron i
+    struct RowKernels k; // row primitives specialised for nin
+};
+
+struct Network {
+    int nlayers;
+    int maxWidth; // widest layer output
+    struct Layer layer[MAX_LAYERS];
+    void *map;      // mapping of the model file the weights live in, or NULL
+    size_t mapSize;
+};
+
+// **********************************************************
+// Bodies of the row primitives. They are always inlined, so calling them with
+// a constant n produces a specialised kernel.
+static inline __attribute__((always_inline)) nn_real dotBody(const nn_weight *w, const nn_real *x, int n) {
+    nn_real sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (int j = 0; j < n; j++) {
+        sum += LOADW(w[j]) * x[j];
+    }
+    return sum;
+}
+
+static inline __attribute__((always_inline)) void dotTileBody(const nn_weight *w0, const nn_weight *w1,
+        const nn_real *x0, const nn_real *x1, const nn_real *x2, const nn_real *x3, nn_real out[2][4], int n) {
+    nn_real s00 = 0, s01 = 0, s02 = 0, s03 = 0;
+    nn_real s10 = 0, s11 = 0, s12 = 0, s13 = 0;
+    #pragma omp simd reduction(+:s00,s01,s02,s03,s10,s11,s12,s13)
+    for (int j = 0; j < n; j++) {
+        nn_real register a = LOADW(w0[j]);
+        nn_real register b = LOADW(w1[j]);
+        s00 += a * x0[j];
+        s01 += a * x1[j];
+        s02 += a * x2[j];
+        s03 += a * x3[j];
+        s10 += b * x0[j];
+        s11 += b * x1[j];
+        s12 += b * x2[j];
+        s13 += b * x3[j];
+    }
+    out[0][0] = s00; out[0][1] = s01; out[0][2] = s02; out[0][3] = s03;
+    out[1][0] = s10; out[1][1] = s11; out[1][2] = s12; out[1][3] = s13;
+}
+
+static inline __attribute__((always_inline)) void updateRowBody(nn_weight *w, nn_real g, const nn_real *x, uint32_t salt, int n) {
+    (void)salt;
+    #pragma omp simd
+    for (int j = 0; j < n; j++) {
+        STOREW(w[j], LOADW(w[j]) + g * x[j], salt + j);
+    }
+}
+
+static inline __attribute__((always_inline)) void axpyWeightsBody(nn_real *y, nn_real g, const nn_weight *w, int n) {
+    #pragma omp simd
+    for (int j = 0; j < n; j++) {
+        y[j] += g * LOADW(w[j]);
+    }
+}
+
+static inline __attribute__((always_inline)) void axpyRowsBody(nn_real *y, const nn_real *g, int gstride,
+        const nn_real *X, int rows, int n) {
+    for (int b = 0; b < rows; b++) {
+        nn_real register gb = g[(size_t)b * gstride];
+        const nn_real *x = X + (size_t)b * n;
+        #pragma omp simd
+        for (int j = 0; j < n; j++) {
+            y[j] += gb * x[j];
+        }
+    }
+}
+
+// **********************************************************
+// Generic and width-specialised instances of the row primitives.
+#define DEFINE_ROW_KERNELS(SUFFIX, N)                                                                     \
+    static nn_real dot_##SUFFIX(const nn_weight *w, const nn_real *x, int n) {                           \
+        (void)n;                                                                                          \
+        return dotBody(w, x, N);                                                                          \
+    }                                                                                                     \
+    static void dotTile_##SUFFIX(const nn_weight *w0, const nn_weight *w1, const nn_real *x0,             \
+                                 const nn_real *x1, const nn_real *x2, const nn_real *x3,                 \
+                                 nn_real out[2][4], int n) {                                              \
+        (void)n;                                                                                          \
+        dotTileBody(w0, w1, x0, x1, x2, x3, out, N);                                                      \
+    }                                                                                                     \
+    static void updateRow_##SUFFIX(nn_weight *w, nn_real g, const nn_real *x, uint32_t salt, int n) {    \
+        (void)n;                                                                                          \
+        updateRowBody(w, g, x, salt, N);                                                                  \
+    }                                                                                                     \
+    static void axpyWeights_##SUFFIX(nn_real *y, nn_real g, const nn_weight *w, int n) {                 \
+        (void)n;                                                                                          \
+        axpyWeightsBody(y, g, w, N);                                                                      \
+    }                                                                                                     \
+    static void axpyRows_##SUFFIX(nn_real *y, const nn_real *g, int gstride, const nn_real *X, int rows, \
+                                  int n) {                                                                \
+        (void)n;                                                                                          \
+        axpyRowsBody(y, g, gstride, X, rows, N);                                                          \
+    }
+
+DEFINE_ROW_KERNELS(generic, n)
+#define DEFINE_SPECIALISED(W) DEFINE_ROW_KERNELS(W, W)
+SPECIALISED_WIDTHS(DEFINE_SPECIALISED)
+
+// **********************************************************
+// Returns the row primitives for a layer input width.
+struct RowKernels rowKernelsFor(int nin) {
+#define PICK_SPECIALISED(W)                                                                  \
+    if (nin == W)                                                                            \
+        return (struct RowKernels){dot_##W, dotTile_##W, updateRow_##W, axpyWeights_##W, axpyRows_##W};
+    SPECIALISED_WIDTHS(PICK_SPECIALISED)
+    return (struct RowKernels){dot_generic, dotTile_generic, updateRow_generic, axpyWeights_generic, axpyRows_generic};
+}
+
+// **********************************************************
+// Frees the weights of a network.
+void freeNetwork(struct Network *net) {
+    for (int l = 0; l < net->nlayers; l++) {
+        if (net->map == NULL)
+            free(net->layer[l].W);
+        net->layer[l].W = NULL;
+    }
+    if (net->map != NULL)
+        munmap(net->map, net->mapSize);
+    net->map = NULL;
+}
+
+// **********************************************************
+// Stochastic rounding salt of row i of layer l for the given update step.
+static inline uint32_t rowSalt(unsigned int step, int l, int i) {
+    return SR_SALT(step + (unsigned int)l * 0x3C6EF372u, i, 0);
+}
+
+// **********************************************************
+// Builds the layers of a network from the topology string spec, which is
+// modified by strtok. Returns 0 on success.
+static int parseTopology(struct Network *net, char *spec) {
+    net->nlayers = 0;
+    net->maxWidth = NINPUT;
+    net->map = NULL;
+    int nin = NINPUT;
+    for (char *tok = strtok(spec, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (net->nlayers == MAX_LAYERS) {
+            printf("At most %d layers are supported\n", MAX_LAYERS);
+            return -1;
+        }
+        struct Layer *L = &net->layer[net->nlayers++];
+        char *actName = strchr(tok, ':');
+        L->nin = nin;
+        L->nout = atoi(tok);
+        L->act = actName == NULL ? ACT_LOGISTIC : activationFromName(actName + 1);
+        if (L->act < 0) {
+            printf("Unknown activation function %s\n", actName + 1);
+            return -1;
+        }
+        if (L->nout <= 0) {
+            printf("Invalid layer size %s\n", tok);
+            return -1;
+        }
+        int perLine = 64 / sizeof(nn_weight);
+        L->ld = (nin + 1 + perLine - 1) / perLine * perLine;
+        L->W = aligned_alloc(64, (size_t)L->nout * L->ld * sizeof(nn_weight));
+        if (L->W == NULL) {
+            printf("Could not allocate the weights of layer %d\n", net->nlayers);
+            return -1;
+        }
+        memset(L->W, 0, (size_t)L->nout * L->ld * sizeof(nn_weight));
+        L->k = rowKernelsFor(nin);
+        if (L->nout > net->maxWidth)
+            net->maxWidth = L->nout;
+        nin = L->nout;
+    }
+    if (net->nlayers == 0 || nin != NCLASSES) {
+        printf("The last layer must have %d neurons\n", NCLASSES);
+        return -1;
+    }
+    for (int l = 0; l < net->nlayers - 1; l++) {
+        if (net->layer[l].act == ACT_SOFTMAX) {
+            printf("Softmax is only supported on the output layer\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Builds a network from a topology string of comma separated "size:activation"
+// layers (the activation defaults to logistic). Returns 0 on success.
+int buildNetwork(struct Network *net, const char *topology) {
+    char *spec = strdup(topology); // topologies of any length
+    if (spec == NULL)
+        return -1;
+    int status = parseTopology(net, spec);
+    free(spec);
+    return status;
+}
+
+// **********************************************************
+// Copies the weights of src into dst, which must have the same topology.
+void copyWeights(struct Network *dst, const struct Network *src) {
+    for (int l = 0; l < src->nlayers; l++) {
+        const struct Layer *L = &src->layer[l];
+        memcpy(dst->layer[l].W, L->W, (size_t)L->nout * L->ld * sizeof(nn_weight));
+    }
+}
+
+// **********************************************************
+// Allocates a network with the same topology as src and copies its weights.
+// Returns 0 on success.
+int cloneNetwork(struct Network *dst, const struct Network *src) {
+    *dst = *src;
+    dst->map = NULL;
+    for (int l = 0; l < src->nlayers; l++) {
+        const struct Layer *L = &src->layer[l];
+        dst->layer[l].W = aligned_alloc(64, (size_t)L->nout * L->ld * sizeof(nn_weight));
+        if (dst->layer[l].W == NULL) {
+            dst->nlayers = l;
+            freeNetwork(dst);
+            return -1;
+        }
+    }
+    copyWeights(dst, src);
+    return 0;
+}
+
+// **********************************************************
+// Initializes neuron synapses' weights with values from a normal distribution.
+// Logistic layers keep the original N(0,1) weights, (leaky) ReLU layers use He
+// initialization and softmax layers LeCun initialization, since their
+// unbounded inputs would otherwise blow up with unit variance weights.
+// Neuron i of layer l takes draws i * (nin + 1) onwards of stream
+// STREAM_WEIGHTS + l, so the rows are generated in parallel and the network
+// does not depend on the number of threads. Returns 0 on success.
+int initVecs(struct Network *net) {
+    int nThreads = omp_get_max_threads();
+    for (int l = 0; l < net->nlayers; l++) {
+        struct Layer *L = &net->layer[l];
+        double register stddev = 1;
+        if (L->act == ACT_RELU || L->act == ACT_LEAKY_RELU)
+            stddev = sqrt(2.0 / L->nin);
+        else if (L->act == ACT_SOFTMAX)
+            stddev = sqrt(1.0 / L->nin);
+        double *rows = malloc((size_t)nThreads * (L->nin + 1) * sizeof(double)); // one row per thread
+        if (rows == NULL)
+            return -1;
+        #pragma omp parallel num_threads(nThreads)
+        {
+            double *row = rows + (size_t)omp_get_thread_num() * (L->nin + 1);
+            #pragma omp for schedule(static)
+            for (int i = 0; i < L->nout; i++) {
+                rngNormalArray(RNG_SEED, STREAM_WEIGHTS + l, (uint64_t)i * (L->nin + 1), row, L->nin + 1);
+                for (int j = 0; j < L->nin + 1; j++) {
+                    STOREW(L->W[(size_t)i * L->ld + j], row[j] * stddev, rowSalt(0, l, i) + j);
+                }
+            }
+        }
+        free(rows);
+    }
+    return 0;
+}
+
+// **********************************************************
+// Allocates an activation and a delta buffer of rows x nout values for every
+// layer of the network. Returns 0 on success, and frees the buffers it
+// allocated on failure.
+int allocLayerBuffers(const struct Network *net, int rows, nn_real **out, nn_real **delta) {
+    for (int l = 0; l < net->nlayers; l++) {
+        size_t size = ((size_t)rows * net->layer[l].nout * sizeof(nn_real) + 63) / 64 * 64;
+        out[l] = aligned_alloc(64, size);
+        delta[l] = aligned_alloc(64, size);
+        if (out[l] == NULL || delta[l] == NULL) {
+            printf("Could not allocate the buffers of layer %d\n", l + 1);
+            for (; l >= 0; l--) {
+                free(out[l]);
+                free(delta[l]);
+                out[l] = delta[l] = NULL;
+            }
+            return -1;
+        }
+        memset(out[l], 0, size);
+        memset(delta[l], 0, size);
+    }
+    return 0;
+}
+
+// **********************************************************
+// Prints the topology of the network.
+void printNetwork(const struct Network *net) {
+    printf("%d", NINPUT);
+    for (int l = 0; l < net->nlayers; l++) {
+        printf(" -> %d (%s)", net->layer[l].nout, activationNames[net->layer[l].act]);
+    }
+    printf("\n");
+}
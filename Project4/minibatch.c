@@ -0,0 +1,204 @@
+/*
+    Mini-batch training path for the neural network.
+
+    Instead of pushing one sample at a time through the network (which forks
+    2 OpenMP regions per layer and sample), a whole batch of BATCH_SIZE samples
+    is taken from a contiguous buffer (filled by the input pipeline of
+    prefetch.c) and the forward pass, backward pass
+    and weight update are computed as blocked matrix-matrix products inside a
+    single parallel region.
+
+    The gradient is averaged over the batch and applied with BATCH_ALPHA, which
+    by default follows the linear scaling rule (ALPHA * BATCH_SIZE) so that one
+    epoch moves the weights about as far as one per-sample epoch does.
+*/
+#include <math.h>
+#include <omp.h>
+#include <string.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef BATCH_ALPHA
+#define BATCH_ALPHA (ALPHA * BATCH_SIZE) // learning rate of the batch-averaged gradient
+#endif
+#define TILE_ROWS 2       // weight rows per register tile
+#define TILE_SAMPLES 4    // batch samples per register tile
+#define BATCH_ROWS ((BATCH_SIZE + TILE_SAMPLES - 1) / TILE_SAMPLES * TILE_SAMPLES) // batch buffer rows, padded to whole tiles
+// **********************************************************
+// BATCH BUFFERS
+nn_real *batchOut[MAX_LAYERS];   // BATCH_ROWS x nout outputs of every layer
+nn_real *batchDelta[MAX_LAYERS]; // BATCH_ROWS x nout deltas of every layer
+
+// **********************************************************
+// Allocates the per-layer batch buffers of a network. Returns 0 on success.
+int initBatchBuffers(const struct Network *net) {
+    return allocLayerBuffers(net, BATCH_ROWS, batchOut, batchDelta);
+}
+
+// **********************************************************
+// Computes the outputs of tile (it, bt) of a layer for a batch of bs inputs:
+// Y[b][i] = act(W[i].X[b] + bias_i) for TILE_ROWS neurons and TILE_SAMPLES
+// samples, so that every loaded weight and input element is reused from
+// registers. Softmax layers are left as logits.
+static inline void forwardTile(const struct Layer *L, const nn_real *X, nn_real *Y, int bs, int it, int bt) {
+    int nin = L->nin, nout = L->nout;
+    int i0 = it * TILE_ROWS;
+    int b0 = bt * TILE_SAMPLES;
+    if (i0 + TILE_ROWS <= nout && b0 + TILE_SAMPLES <= bs) {
+        const nn_weight *w[TILE_ROWS] = {L->W + (size_t)i0 * L->ld, L->W + (size_t)(i0 + 1) * L->ld};
+        const nn_real *x0 = X + (size_t)b0 * nin;
+        nn_real s[TILE_ROWS][TILE_SAMPLES];
+        L->k.dotTile(w[0], w[1], x0, x0 + nin, x0 + 2 * nin, x0 + 3 * nin, s, nin);
+        for (int r = 0; r < TILE_ROWS; r++) {
+            nn_real register bias = LOADW(w[r][nin]);
+            for (int c = 0; c < TILE_SAMPLES; c++) {
+                s[r][c] += bias;
+            }
+        }
+        // the whole tile goes through the activation as one vector
+        if (L->act != ACT_SOFTMAX)
+            activateArray(L->act, &s[0][0], TILE_ROWS * TILE_SAMPLES);
+        for (int r = 0; r < TILE_ROWS; r++) {
+            for (int c = 0; c < TILE_SAMPLES; c++) {
+                Y[(size_t)(b0 + c) * nout + i0 + r] = s[r][c];
+            }
+        }
+    }
+    else { // edge tile
+        for (int i = i0; i < i0 + TILE_ROWS && i < nout; i++) {
+            const nn_weight *w = L->W + (size_t)i * L->ld;
+            for (int b = b0; b < b0 + TILE_SAMPLES && b < bs; b++) {
+                nn_real register sum = L->k.dot(w, X + (size_t)b * nin, nin);
+                Y[(size_t)b * nout + i] = activate(L->act, sum + LOADW(w[nin]));
+            }
+        }
+    }
+}
+
+// **********************************************************
+// Computes Y[b][i] = act(W[i].X[b] + bias_i) for a batch of bs inputs,
+// split in register tiles. Must be called from inside a parallel region.
+void batchForward(const struct Layer *L, const nn_real *X, nn_real *Y, int bs) {
+    int rowTiles = (L->nout + TILE_ROWS - 1) / TILE_ROWS;
+    int sampleTiles = (bs + TILE_SAMPLES - 1) / TILE_SAMPLES;
+    #pragma omp for collapse(2) schedule(static)
+    for (int it = 0; it < rowTiles; it++) {
+        for (int bt = 0; bt < sampleTiles; bt++) {
+            forwardTile(L, X, Y, bs, it, bt);
+        }
+    }
+    // softmax is applied per sample once the layer is complete
+    if (L->act == ACT_SOFTMAX) {
+        #pragma omp for schedule(static)
+        for (int b = 0; b < bs; b++) {
+            softmaxArray(Y + (size_t)b * L->nout, L->nout);
+        }
+    }
+}
+
+// **********************************************************
+// Back-propagates the deltas of a layer through its weights:
+// Dprev[b][j] = (sum_i W[i][j] * D[b][i]) * act'(O[b][j]),
+// where O holds the outputs of the previous layer and prevAct its activation.
+// Must be called from inside a parallel region.
+void batchBackward(const struct Layer *L, int prevAct, const nn_real *D, const nn_real *O, nn_real *Dprev, int bs) {
+    int nin = L->nin, nout = L->nout;
+    #pragma omp for schedule(static)
+    for (int b = 0; b < bs; b++) {
+        nn_real *dp = Dprev + (size_t)b * nin;
+        const nn_real *o = O + (size_t)b * nin;
+        const nn_real *d = D + (size_t)b * nout;
+        #pragma omp simd
+        for (int j = 0; j < nin; j++) {
+            dp[j] = 0;
+        }
+        for (int i = 0; i < nout; i++) {
+            L->k.axpyWeights(dp, d[i], L->W + (size_t)i * L->ld, nin);
+        }
+        multiplyDerivative(prevAct, o, dp, nin);
+    }
+}
+
+// **********************************************************
+// Applies the batch-averaged gradient to layer l:
+// W[i][j] -= lr * sum_b D[b][i] * X[b][j].
+// Each thread owns whole weight rows. The gradient of a row is accumulated
+// in a private buffer over the batch and then applied with a single
+// read-modify-write of the row (and a single rounding when it is bf16).
+// Must be called from inside a parallel region.
+void batchUpdate(struct Layer *L, int l, const nn_real *X, const nn_real *D, int bs, nn_real lr, unsigned int step) {
+    int nin = L->nin, nout = L->nout;
+    nn_real grad[nin] __attribute__((aligned(64)));
+    #pragma omp for schedule(static) nowait
+    for (int i = 0; i < nout; i++) {
+        nn_weight *w = L->W + (size_t)i * L->ld;
+        nn_real biasGrad = 0;
+        #pragma omp simd
+        for (int j = 0; j < nin; j++) {
+            grad[j] = 0;
+        }
+        L->k.axpyRows(grad, D + i, nout, X, bs, nin);
+        for (int b = 0; b < bs; b++) {
+            biasGrad += D[(size_t)b * nout + i];
+        }
+        L->k.updateRow(w, -lr, grad, rowSalt(step, l, i), nin);
+        STOREW(w[nin], LOADW(w[nin]) - lr * biasGrad, rowSalt(step, l, i) + nin);
+    }
+}
+
+// **********************************************************
+// Writes the summed gradient of layer l over the batch to G, which is laid
+// out like the weights (nout rows of ld values, the bias gradient at column
+// nin): G[i][j] = sum_b D[b][i] * X[b][j]. Must be called from inside a
+// parallel region.
+void batchGradient(const struct Layer *L, const nn_real *X, const nn_real *D, int bs, nn_real *G) {
+    int nin = L->nin, nout = L->nout;
+    #pragma omp for schedule(static)
+    for (int i = 0; i < nout; i++) {
+        nn_real *g = G + (size_t)i * L->ld;
+        nn_real biasGrad = 0;
+        #pragma omp simd
+        for (int j = 0; j < nin; j++) {
+            g[j] = 0;
+        }
+        L->k.axpyRows(g, D + i, nout, X, bs, nin);
+        for (int b = 0; b < bs; b++) {
+            biasGrad += D[(size_t)b * nout + i];
+        }
+        g[nin] = biasGrad;
+    }
+}
+
+// **********************************************************
+// Trains the network on the bs normalised inputs X (bs x NINPUT values) of
+// the given classes. All phases run in one parallel region, separated by the
+// implicit barriers of the worksharing loops.
+void trainBatchNN(const nn_real *X, const int *classes, int bs) {
+    nn_real register lr = BATCH_ALPHA / bs;
+    unsigned int step = ++updateStep;
+    int last = net.nlayers - 1;
+    double loss = 0;
+    PROFILE_START(t);
+    #pragma omp parallel
+    {
+        for (int l = 0; l <= last; l++) {
+            batchForward(&net.layer[l], l == 0 ? X : batchOut[l - 1], batchOut[l], bs);
+        }
+        PROFILE_LAP(t, PHASE_FORWARD, 1);
+        // Output layer deltas
+        #pragma omp for schedule(static) reduction(+:loss)
+        for (int b = 0; b < bs; b++) {
+            loss += outputDelta(net.layer[last].act, batchOut[last] + b * NCLASSES, classes[b],
+                                batchDelta[last] + b * NCLASSES);
+        }
+        for (int l = last; l > 0; l--) {
+            batchBackward(&net.layer[l], net.layer[l - 1].act, batchDelta[l], batchOut[l - 1], batchDelta[l - 1], bs);
+        }
+        PROFILE_LAP(t, PHASE_BACKWARD, 0);
+        for (int l = 0; l <= last; l++) {
+            batchUpdate(&net.layer[l], l, l == 0 ? X : batchOut[l - 1], batchDelta[l], bs, lr, step);
+        }
+    }
+    PROFILE_LAP(t, PHASE_UPDATE, 0);
+    lossSum += loss;
+    lossCount += bs;
+}
@@ -0,0 +1,169 @@
+/*
+    Saving and loading of trained networks.
+
+    A model file holds the topology and the weights of a network exactly as
+    they are laid out in memory, so loading it is a single mmap: the layers
+    point straight into the mapping and are used by every training and
+    inference path without any copy or parsing. It also holds the
+    normalisation statistics of the training set, which every input fed to
+    the network must be normalised with.
+
+        header (64 bytes) | layer table (MAX_LAYERS x 32 bytes) | feature statistics
+        | W of layer 0 | W of layer 1 | ...
+
+    Every weight block starts at a multiple of 64 bytes and keeps the padded
+    row stride (ld) of the layer. The weights are stored in the precision the
+    program was compiled with, and a model can only be loaded by a build with
+    the same precision. The mapping is private, so a loaded model can be
+    trained further without modifying its file.
+*/
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// **********************************************************
+// DEFINITIONS
+#define MODEL_MAGIC "FMNN"
+#define MODEL_VERSION 2
+#define MODEL_ALIGN 64
+// **********************************************************
+// STRUCTS
+struct ModelHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t precision;  // PRECISION of the build that wrote the file
+    uint32_t weightSize; // bytes per weight
+    uint32_t ninput;
+    uint32_t nclasses;
+    uint32_t nlayers;
+    char pad[MODEL_ALIGN - 28];
+};
+
+struct ModelLayer {
+    uint32_t nin;
+    uint32_t nout;
+    uint32_t ld;
+    uint32_t act;
+    uint64_t offset; // file offset of the layer's weights
+    uint64_t pad;
+};
+
+// **********************************************************
+// Size of the header, layer table and statistics of a model file.
+size_t modelTableSize(void) {
+    size_t size = sizeof(struct ModelHeader) + MAX_LAYERS * sizeof(struct ModelLayer) + sizeof(struct FeatureStats);
+    return (size + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+}
+
+// **********************************************************
+// Writes the network and the statistics its inputs are normalised with to a
+// model file. Returns 0 on success.
+int saveModel(const struct Network *net, const struct FeatureStats *stats, const char *path) {
+    struct ModelHeader h = {0};
+    struct ModelLayer table[MAX_LAYERS] = {{0}};
+    memcpy(h.magic, MODEL_MAGIC, 4);
+    h.version = MODEL_VERSION;
+    h.precision = PRECISION;
+    h.weightSize = sizeof(nn_weight);
+    h.ninput = NINPUT;
+    h.nclasses = NCLASSES;
+    h.nlayers = net->nlayers;
+    uint64_t offset = modelTableSize();
+    for (int l = 0; l < net->nlayers; l++) {
+        const struct Layer *L = &net->layer[l];
+        table[l] = (struct ModelLayer){L->nin, L->nout, L->ld, L->act, offset, 0};
+        offset += (uint64_t)L->nout * L->ld * sizeof(nn_weight);
+    }
+
+    char tmpPath[4096];
+    FILE *fp = openTempFile(path, tmpPath);
+    static const char zeros[MODEL_ALIGN] = {0};
+    size_t pad = modelTableSize() - sizeof(h) - sizeof(table) - sizeof(*stats);
+    int ok = fp != NULL && fwrite(&h, sizeof(h), 1, fp) == 1 && fwrite(table, sizeof(table), 1, fp) == 1 &&
+             fwrite(stats, sizeof(*stats), 1, fp) == 1 && fwrite(zeros, 1, pad, fp) == pad;
+    for (int l = 0; ok && l < net->nlayers; l++) {
+        const struct Layer *L = &net->layer[l];
+        size_t count = (size_t)L->nout * L->ld;
+        ok = fwrite(L->W, sizeof(nn_weight), count, fp) == count;
+    }
+    if (commitTempFile(fp, ok, tmpPath, path) != 0) {
+        fprintf(stderr, "Could not write model %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// **********************************************************
+// Maps a model file, builds the network on top of it and copies its
+// normalisation statistics to stats. Returns 0 on success, -1 if the file
+// cannot be read and -2 if it is not a valid model for this build.
+int loadModel(struct Network *net, struct FeatureStats *stats, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Could not open model %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < modelTableSize()) {
+        printf("Could not load model %s: not a model file\n", path);
+        close(fd);
+        return -2;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Could not map model %s\n", path);
+        return -1;
+    }
+    const struct ModelHeader *h = map;
+    const struct ModelLayer *table = (const struct ModelLayer *)((char *)map + sizeof(struct ModelHeader));
+    const char *error = NULL;
+    if (memcmp(h->magic, MODEL_MAGIC, 4) != 0)
+        error = "not a model file";
+    else if (h->version != MODEL_VERSION)
+        error = "unsupported model version";
+    else if (h->precision != PRECISION || h->weightSize != sizeof(nn_weight))
+        error = "model was saved with a different PRECISION";
+    else if (h->ninput != NINPUT || h->nclasses != NCLASSES || h->nlayers == 0 || h->nlayers > MAX_LAYERS)
+        error = "incompatible topology";
+
+    net->nlayers = error == NULL ? h->nlayers : 0;
+    net->maxWidth = NINPUT;
+    int nin = NINPUT;
+    for (int l = 0; l < net->nlayers && error == NULL; l++) {
+        const struct ModelLayer *m = &table[l];
+        struct Layer *L = &net->layer[l];
+        if (m->nin != (uint32_t)nin || m->nout == 0 || m->ld < m->nin + 1 || m->act >= N_ACTIVATIONS ||
+            m->offset % MODEL_ALIGN != 0 ||
+            m->offset + (uint64_t)m->nout * m->ld * sizeof(nn_weight) > (uint64_t)st.st_size) {
+            error = "corrupted layer table";
+            break;
+        }
+        L->nin = m->nin;
+        L->nout = m->nout;
+        L->ld = m->ld;
+        L->act = m->act;
+        L->W = (nn_weight *)((char *)map + m->offset);
+        L->k = rowKernelsFor(L->nin);
+        if (L->nout > net->maxWidth)
+            net->maxWidth = L->nout;
+        nin = L->nout;
+    }
+    if (error == NULL && nin != NCLASSES)
+        error = "incompatible topology";
+    if (error != NULL) {
+        printf("Could not load model %s: %s\n", path, error);
+        munmap(map, st.st_size);
+        net->nlayers = 0;
+        net->map = NULL;
+        return -2;
+    }
+    memcpy(stats, (char *)table + MAX_LAYERS * sizeof(struct ModelLayer), sizeof(*stats));
+    net->map = map;
+    net->mapSize = st.st_size;
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+    Numeric precision of the neural network.
+
+    PRECISION selects the type of the weights, activations and deltas:
+      PREC_DOUBLE  everything in double (the original implementation)
+      PREC_FLOAT   everything in float, which doubles the SIMD width and halves
+                   the memory traffic of the inner loops
+      PREC_BF16    weights stored as bfloat16, all arithmetic in float. Updates
+                   are written back with stochastic rounding, since the
+                   ALPHA * gradient steps are mostly far below half a bf16 ulp
+                   and would be lost with round-to-nearest.
+
+    The inputs are kept as the raw uint8 pixels in every mode and normalised
+    on the fly when they are fed to the network.
+
+    Kernels read weights with LOADW() and write them with STOREW(), which
+    reduce to plain loads and stores unless the weights are bf16.
+*/
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+// **********************************************************
+// DEFINITIONS
+#define PREC_DOUBLE 0
+#define PREC_FLOAT 1
+#define PREC_BF16 2
+#ifndef PRECISION
+#define PRECISION PREC_DOUBLE
+#endif
+// **********************************************************
+// TYPES
+#if PRECISION == PREC_DOUBLE
+typedef double nn_real;
+#define NN_EXP exp
+#define PRECISION_NAME "double"
+#else
+typedef float nn_real;
+#define NN_EXP expf
+#define PRECISION_NAME (PRECISION == PREC_FLOAT ? "float" : "bf16 weights, float arithmetic")
+#endif
+
+#if PRECISION == PREC_BF16
+typedef uint16_t nn_weight;
+#define LOADW(w) bf16ToFloat(w)
+#define STOREW(w, x, salt) ((w) = floatToBf16(x, srBits(salt)))
+#else
+typedef nn_real nn_weight;
+#define LOADW(w) (w)
+#define STOREW(w, x, salt) ((w) = (x), (void)(salt))
+#endif
+
+// **********************************************************
+// Converts a bfloat16 value to float.
+static inline float bf16ToFloat(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// **********************************************************
+// Converts a float to bfloat16, rounding stochastically with the 16 random
+// bits in r: the value is rounded up with probability equal to the fraction
+// of the ulp that is truncated, so updates are unbiased on average.
+static inline uint16_t floatToBf16(float f, uint32_t r) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return (uint16_t)((bits + (r & 0xFFFF)) >> 16);
+}
+
+// **********************************************************
+// Cheap, vectorisable hash that provides the random bits of the stochastic
+// rounding. The salt must differ between the weights and updates it is used for.
+static inline uint32_t srBits(uint32_t salt) {
+    salt *= 0x9E3779B1u;
+    salt ^= salt >> 15;
+    salt *= 0x85EBCA77u;
+    return salt >> 16;
+}
+
+// **********************************************************
+// Combines an update counter, a weight row and a column into a rounding salt.
+#define SR_SALT(step, row, col) ((uint32_t)(step) * 0x632BE5ABu + (uint32_t)(row) * 0x10001u + (uint32_t)(col))
@@ -0,0 +1,185 @@
+/*
+    Shuffled, prefetched input pipeline for training.
+
+    Instead of drawing random samples with replacement, training walks
+    through a new random permutation of the training set every epoch. A
+    background thread gathers the next batch of the permutation, already
+    normalised, into one of two aligned buffers while the network trains on
+    the other one, so the scattered reads of the dataset and the
+    normalisation overlap with the computation.
+
+    The consumer gets batches from nextBatch(). A buffer is handed back to the
+    producer when the next one is requested. A sparse pipeline produces the
+    lists of nonzero pixels of the samples (sparse.c) instead of normalised
+    inputs, read with sparseBatch().
+*/
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef PREFETCH_BATCH
+#define PREFETCH_BATCH 64 // samples per prefetched buffer of the per-sample training mode
+#endif
+// **********************************************************
+// STRUCTS
+struct Prefetcher {
+    const unsigned char (*data)[DATA_STRIDE];
+    const int *classes;
+    const struct FeatureStats *stats;
+    int count;              // examples in the dataset
+    int bs;                 // samples per batch
+    long total;             // samples to produce
+    nn_real *in[2];         // bs x NINPUT normalised inputs of each buffer
+    struct SparseSample *sp[2]; // bs sparse samples of each buffer, if sparse
+    int *cls[2];            // bs classes of each buffer
+    int size[2];            // samples in each buffer
+    int filled[2];          // buffer is ready for the consumer
+    long consumed;          // batches handed to the consumer
+    int *perm;              // permutation of the current epoch
+    int pos;                // next position in perm
+    struct Rng rng;         // shuffling stream
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+// **********************************************************
+// Shuffles the permutation for a new epoch (Fisher-Yates).
+void shuffleEpoch(struct Prefetcher *p) {
+    for (int i = p->count - 1; i > 0; i--) {
+        int j = rngBelow(&p->rng, i + 1);
+        int tmp = p->perm[i];
+        p->perm[i] = p->perm[j];
+        p->perm[j] = tmp;
+    }
+    p->pos = 0;
+}
+
+// **********************************************************
+// Body of the producer thread: fills the two buffers in turn.
+void *prefetchThread(void *arg) {
+    struct Prefetcher *p = arg;
+    long batches = (p->total + p->bs - 1) / p->bs;
+    for (long k = 0; k < batches; k++) {
+        int b = k & 1;
+        pthread_mutex_lock(&p->lock);
+        while (p->filled[b]) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        int n = p->total - k * p->bs < p->bs ? p->total - k * p->bs : p->bs;
+        for (int r = 0; r < n; r++) {
+            if (p->pos == p->count)
+                shuffleEpoch(p);
+            int idx = p->perm[p->pos++];
+            if (p->sp[b] != NULL)
+                sparseInput(p->data[idx], p->stats, &p->sp[b][r]);
+            else
+                normalizeInput(p->data[idx], p->stats, p->in[b] + (size_t)r * NINPUT);
+            p->cls[b][r] = p->classes[idx];
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->size[b] = n;
+        p->filled[b] = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+// **********************************************************
+// Frees the buffers of the pipeline.
+static void freePrefetcher(struct Prefetcher *p) {
+    for (int b = 0; b < 2; b++) {
+        free(p->in[b]);
+        free(p->sp[b]);
+        free(p->cls[b]);
+    }
+    free(p->perm);
+}
+
+// **********************************************************
+// Starts producing total shuffled samples of the count examples of data, in
+// batches of bs, shuffled with the given random stream, as sparse samples if
+// sparse is set. Returns 0 on success.
+int startPrefetcher(struct Prefetcher *p, const unsigned char data[][DATA_STRIDE], const int *classes,
+                    const struct FeatureStats *stats, int count, int bs, long total, uint64_t stream, int sparse) {
+    p->data = data;
+    p->classes = classes;
+    p->stats = stats;
+    p->count = count;
+    p->bs = bs;
+    p->total = total;
+    p->consumed = 0;
+    p->rng = rngStream(RNG_SEED, stream);
+    p->perm = malloc(count * sizeof(int));
+    int failed = p->perm == NULL;
+    for (int b = 0; b < 2; b++) {
+        p->in[b] = sparse ? NULL : aligned_alloc(64, ((size_t)bs * NINPUT * sizeof(nn_real) + 63) / 64 * 64);
+        p->sp[b] = sparse ? aligned_alloc(64, ((size_t)bs * sizeof(struct SparseSample) + 63) / 64 * 64) : NULL;
+        p->cls[b] = malloc(bs * sizeof(int));
+        p->filled[b] = 0;
+        failed |= (sparse ? p->sp[b] == NULL : p->in[b] == NULL) || p->cls[b] == NULL;
+    }
+    if (failed) {
+        freePrefetcher(p);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        p->perm[i] = i;
+    }
+    p->pos = count; // shuffle before the first sample
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, prefetchThread, p) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        freePrefetcher(p);
+        return -1;
+    }
+    return 0;
+}
+
+// **********************************************************
+// Hands the previous batch back to the producer and waits for the next one.
+// Returns the number of samples in it, or 0 once all samples were produced.
+int nextBatch(struct Prefetcher *p, const nn_real **in, const int **cls) {
+    long batches = (p->total + p->bs - 1) / p->bs;
+    pthread_mutex_lock(&p->lock);
+    if (p->consumed > 0) {
+        p->filled[(p->consumed - 1) & 1] = 0;
+        pthread_cond_broadcast(&p->cond);
+    }
+    if (p->consumed == batches) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+    int b = p->consumed & 1;
+    while (!p->filled[b]) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    p->consumed++;
+    *in = p->in[b];
+    *cls = p->cls[b];
+    return p->size[b];
+}
+
+// **********************************************************
+// Returns the sparse samples of the batch returned by the last nextBatch().
+static inline const struct SparseSample *sparseBatch(const struct Prefetcher *p) {
+    return p->sp[(p->consumed - 1) & 1];
+}
+
+// **********************************************************
+// Waits for the producer to finish and frees the pipeline. All batches must
+// have been consumed.
+void stopPrefetcher(struct Prefetcher *p) {
+    pthread_join(p->thread, NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    freePrefetcher(p);
+}
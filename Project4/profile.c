@@ -0,0 +1,272 @@
+/*
+    Instrumentation of the training loop.
+
+    Phase timers: the training paths start a timer with PROFILE_START and close
+    every phase (input, forward pass, backward pass, weight update) with
+    PROFILE_LAP (PROFILE_RESET skips what is timed elsewhere). Only thread 0
+    reads the clock, so a phase that spans a parallel region or ends at a
+    barrier is timed until every thread is done with it, OpenMP overhead
+    included. Every lap also records how many
+    parallel regions the phase opened, and the per-sample path counts the
+    jobs it hands to the thread pool. The cost of an empty parallel region and
+    of an empty pool job are measured at startup, so the share of the
+    training time that goes to dispatching work to the threads can be
+    estimated. Compile with -DPROFILE=0 to remove the timers.
+
+    Hardware counters: when the kernel allows it, cycles, instructions and
+    last-level cache misses are counted with perf_event_open for every OpenMP
+    and pool thread (user space only). When they are not available (e.g. with
+    perf_event_paranoid > 2 or inside most VMs) the counters are reported as
+    null. The prefetch thread and the worker processes of the distributed mode
+    are not counted.
+
+    The training paths also sum the loss of every sample they train on in
+    lossSum. Every epoch appends one JSON object per line to EPOCH_LOG with its
+    throughput, loss, testing accuracy, phase times and counters.
+*/
+#include <linux/perf_event.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef PROFILE
+#define PROFILE 1 // per-phase timers
+#endif
+#ifndef EPOCH_LOG
+#define EPOCH_LOG "./training.jsonl" // per-epoch JSON lines log
+#endif
+#define PHASE_INPUT 0    // waiting for the input pipeline
+#define PHASE_FORWARD 1  // forward pass
+#define PHASE_BACKWARD 2 // output and hidden deltas
+#define PHASE_UPDATE 3   // weight update
+#define N_PHASES 4
+#define N_COUNTERS 3
+#define MAX_PROFILED_THREADS 256
+
+const char *phaseNames[N_PHASES] = {"input", "forward", "backward", "update"};
+const char *counterNames[N_COUNTERS] = {"cycles", "instructions", "llc_misses"};
+// **********************************************************
+// STRUCTS
+struct PhaseTimers {
+    double seconds[N_PHASES]; // time spent in each phase by thread 0
+    long regions[N_PHASES];   // parallel regions opened by each phase
+    long jobs;                // jobs run on the thread pool
+};
+
+struct PerfCounters {
+    int nThreads;
+    int fd[MAX_PROFILED_THREADS][N_COUNTERS];
+    int available;
+};
+// **********************************************************
+// GLOBAL VARS
+struct PhaseTimers phaseTimers;
+struct PerfCounters perfCounters;
+double regionCost; // seconds per empty parallel region
+double jobCost;    // seconds per empty pool job
+double lossSum;    // loss summed over the trained samples
+long lossCount;    // samples in lossSum
+
+// **********************************************************
+// Returns a monotonic time in seconds.
+static inline double profileClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// The calling thread is thread 0 of both OpenMP and the thread pool.
+static inline int profileThread0(void) {
+    return omp_get_thread_num() == 0 && poolThreadId() == 0;
+}
+
+#if PROFILE
+// Declares timer t and starts it.
+#define PROFILE_START(t) double t = profileThread0() ? profileClock() : 0
+// Restarts timer t, leaving out the time since its last start or lap.
+#define PROFILE_RESET(t)                                    \
+    do {                                                    \
+        if (profileThread0())                      \
+            (t) = profileClock();                           \
+    } while (0)
+// Adds the time since t was last started to a phase, and restarts t.
+#define PROFILE_LAP(t, phase, nRegions)                     \
+    do {                                                    \
+        if (profileThread0()) {                    \
+            double now = profileClock();                    \
+            phaseTimers.seconds[phase] += now - (t);        \
+            phaseTimers.regions[phase] += (nRegions);       \
+            (t) = now;                                      \
+        }                                                   \
+    } while (0)
+#else
+#define PROFILE_START(t) (void)0
+#define PROFILE_RESET(t) (void)0
+#define PROFILE_LAP(t, phase, nRegions) (void)0
+#endif
+
+// **********************************************************
+static void emptyJob(void *arg) {
+    (void)arg;
+    __asm__ volatile("" ::: "memory");
+}
+
+// **********************************************************
+// Measures the cost of forking and joining an empty parallel region, and of
+// running an empty job on the thread pool.
+void measureRegionCost(void) {
+    const int reps = 2000;
+    #pragma omp parallel
+    {
+        __asm__ volatile("" ::: "memory"); // keeps the compiler from removing the region
+    }
+    double start = profileClock();
+    for (int i = 0; i < reps; i++) {
+        #pragma omp parallel
+        {
+            __asm__ volatile("" ::: "memory");
+        }
+    }
+    regionCost = (profileClock() - start) / reps;
+    poolRun(emptyJob, NULL);
+    start = profileClock();
+    for (int i = 0; i < reps; i++) {
+        poolRun(emptyJob, NULL);
+    }
+    jobCost = (profileClock() - start) / reps;
+}
+
+// **********************************************************
+// Opens one counter of the calling thread, or returns -1.
+int openCounter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// **********************************************************
+// Opens the counters of the calling thread in row t of pc. Returns 0 on success.
+int openCounters(struct PerfCounters *pc, int t) {
+    const uint64_t configs[N_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    int failed = 0;
+    for (int c = 0; c < N_COUNTERS; c++) {
+        pc->fd[t][c] = openCounter(configs[c]);
+        failed |= pc->fd[t][c] < 0;
+    }
+    return failed ? -1 : 0;
+}
+
+// **********************************************************
+// Pool job opening the counters of the pool workers (thread 0 is an OpenMP
+// thread), after the rows of the OpenMP threads.
+static void openPoolCounters(void *arg) {
+    struct PerfCounters *pc = arg;
+    int t = poolThreadId();
+    int row = pc->nThreads - poolSize() + t;
+    if (t > 0 && openCounters(pc, row) != 0)
+        __atomic_store_n(&pc->available, 0, __ATOMIC_RELAXED);
+}
+
+// **********************************************************
+// Opens the hardware counters in every OpenMP and pool thread. They are read
+// from the main thread, so they only need to be opened once.
+void perfOpen(struct PerfCounters *pc) {
+    int failed = 0;
+    int nOmp = omp_get_max_threads();
+    if (nOmp + poolSize() - 1 > MAX_PROFILED_THREADS)
+        nOmp = MAX_PROFILED_THREADS - poolSize() + 1;
+    pc->nThreads = nOmp + poolSize() - 1;
+    for (int t = 0; t < pc->nThreads; t++) {
+        for (int c = 0; c < N_COUNTERS; c++) {
+            pc->fd[t][c] = -1;
+        }
+    }
+    #pragma omp parallel num_threads(nOmp) reduction(|:failed)
+    failed |= openCounters(pc, omp_get_thread_num()) != 0;
+    pc->available = !failed;
+    poolRun(openPoolCounters, pc);
+    failed = !pc->available;
+    if (failed) {
+        for (int t = 0; t < pc->nThreads; t++) {
+            for (int c = 0; c < N_COUNTERS; c++) {
+                if (pc->fd[t][c] >= 0)
+                    close(pc->fd[t][c]);
+            }
+        }
+    }
+}
+
+// **********************************************************
+// Reads the counters summed over all threads. Returns 0 if they are available.
+int perfRead(const struct PerfCounters *pc, uint64_t values[N_COUNTERS]) {
+    memset(values, 0, N_COUNTERS * sizeof(uint64_t));
+    if (!pc->available)
+        return -1;
+    for (int t = 0; t < pc->nThreads; t++) {
+        for (int c = 0; c < N_COUNTERS; c++) {
+            uint64_t v;
+            if (read(pc->fd[t][c], &v, sizeof(v)) == sizeof(v))
+                values[c] += v;
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Appends the record of one epoch to the log. The phase times and counters
+// are the differences between the values after and before the epoch.
+void logEpoch(FILE *log, int epoch, long samples, double seconds, double loss, double testAccuracy,
+              const struct PhaseTimers *before, const uint64_t countersBefore[N_COUNTERS],
+              const uint64_t countersAfter[N_COUNTERS]) {
+    if (log == NULL)
+        return;
+    long regions = 0;
+    fprintf(log, "{\"epoch\": %d, \"samples\": %ld, \"seconds\": %.4f, \"samples_per_s\": %.1f, \"loss\": %.6f, "
+                 "\"test_accuracy\": %.4f, \"phases\": {",
+            epoch, samples, seconds, samples / seconds, loss, testAccuracy);
+    for (int p = 0; p < N_PHASES; p++) {
+        fprintf(log, "%s\"%s\": %.4f", p > 0 ? ", " : "", phaseNames[p], phaseTimers.seconds[p] - before->seconds[p]);
+        regions += phaseTimers.regions[p] - before->regions[p];
+    }
+    long jobs = phaseTimers.jobs - before->jobs;
+    fprintf(log, "}, \"omp_regions\": %ld, \"pool_jobs\": %ld, \"dispatch_overhead_s\": %.4f", regions, jobs,
+            regions * regionCost + jobs * jobCost);
+    for (int c = 0; c < N_COUNTERS; c++) {
+        if (perfCounters.available)
+            fprintf(log, ", \"%s\": %llu", counterNames[c], (unsigned long long)(countersAfter[c] - countersBefore[c]));
+        else
+            fprintf(log, ", \"%s\": null", counterNames[c]);
+    }
+    fprintf(log, "}\n");
+    fflush(log);
+}
+
+// **********************************************************
+// Prints the time of every phase over the whole training, and the counters.
+void printProfile(double trainSeconds, const uint64_t counters[N_COUNTERS]) {
+    long regions = 0;
+    printf("Time per phase:");
+    for (int p = 0; p < N_PHASES; p++) {
+        printf(" %s %.2fs (%.0f%%)", phaseNames[p], phaseTimers.seconds[p], 100 * phaseTimers.seconds[p] / trainSeconds);
+        regions += phaseTimers.regions[p];
+    }
+    printf("\nOpenMP regions: %ld, estimated fork/join overhead %.2fs (%.2f us per region)\n", regions,
+           regions * regionCost, 1e6 * regionCost);
+    printf("Pool jobs: %ld, estimated dispatch overhead %.2fs (%.2f us per job, %d threads)\n", phaseTimers.jobs,
+           phaseTimers.jobs * jobCost, 1e6 * jobCost, poolSize());
+    if (perfCounters.available)
+        printf("Counters: %llu cycles, %llu instructions (IPC %.2f), %llu LLC misses\n", (unsigned long long)counters[0],
+               (unsigned long long)counters[1], (double)counters[1] / counters[0], (unsigned long long)counters[2]);
+    else
+        printf("Hardware counters unavailable\n");
+}
@@ -0,0 +1,295 @@
+/*
+    int8 post-training quantised inference.
+
+    A trained network is converted to int8 weights with one scale per row
+    (w ~= scale_i * q), and every layer input is quantised with one scale per
+    layer (x ~= inScale * q). The input scales are calibrated by running the
+    floating point network on a subset of the training set and taking the
+    largest absolute input each layer sees. A neuron is then computed as
+
+        z_i = scale_i * inScale * (q_w . q_x) + bias_i
+
+    with the dot product accumulated exactly in int32. Biases, activations and
+    the outputs of the last layer stay in nn_real.
+
+    The int8 dot product uses AVX512-VNNI or AVX-VNNI (vpdpbusd) when the build
+    targets them. vpdpbusd multiplies unsigned by signed bytes, so the
+    activations are offset by 128 on the fly and 128 * sum(q_w) is subtracted
+    from the result. Other targets (AVX2 included) use a plain loop that the
+    compiler vectorises with widening multiply-adds.
+*/
+#include <omp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX512VNNI__) || defined(__AVXVNNI__)
+#include <immintrin.h>
+#endif
+// **********************************************************
+// DEFINITIONS
+#ifndef CALIB_SAMPLES
+#define CALIB_SAMPLES 1000 // training samples used to calibrate the activation scales
+#endif
+#define QALIGN 64 // int8 rows are padded to a multiple of QALIGN bytes
+// **********************************************************
+// STRUCTS
+struct QLayer {
+    int nin;
+    int nout;
+    int ldq;        // row stride of W, a multiple of QALIGN
+    int act;
+    int8_t *W;      // nout x ldq quantised weights, zero padded
+    float *wScale;  // per-row weight scales
+    float *scale;   // wScale * inScale
+    int32_t *corr;  // 128 * row sums of W, for the VNNI offset
+    nn_real *bias;  // biases, not quantised
+    float inScale;  // quantisation step of the layer input
+};
+
+struct QNetwork {
+    int nlayers;
+    int maxLdq;   // widest quantised input
+    int maxWidth; // widest layer output
+    struct QLayer layer[MAX_LAYERS];
+};
+
+// **********************************************************
+// Returns q_w . q_x for two int8 vectors of n values, n a multiple of QALIGN
+// and both vectors aligned to 64 bytes. corr is 128 * sum(q_w).
+static inline int32_t dotI8(const int8_t *w, const int8_t *x, int32_t corr, int n) {
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    const __m512i flip = _mm512_set1_epi8((char)0x80);
+    __m512i acc = _mm512_setzero_si512();
+    for (int j = 0; j < n; j += 64) {
+        __m512i xv = _mm512_xor_si512(_mm512_load_si512(x + j), flip);
+        acc = _mm512_dpbusd_epi32(acc, xv, _mm512_load_si512(w + j));
+    }
+    return _mm512_reduce_add_epi32(acc) - corr;
+#elif defined(__AVXVNNI__)
+    const __m256i flip = _mm256_set1_epi8((char)0x80);
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    for (int j = 0; j < n; j += 64) {
+        __m256i x0 = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(x + j)), flip);
+        __m256i x1 = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(x + j + 32)), flip);
+        acc0 = _mm256_dpbusd_avx_epi32(acc0, x0, _mm256_load_si256((const __m256i *)(w + j)));
+        acc1 = _mm256_dpbusd_avx_epi32(acc1, x1, _mm256_load_si256((const __m256i *)(w + j + 32)));
+    }
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7] - corr;
+#else
+    (void)corr;
+    int32_t sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (int j = 0; j < n; j++) {
+        sum += (int32_t)w[j] * x[j];
+    }
+    return sum;
+#endif
+}
+
+// **********************************************************
+// Quantises n values with step scale into q, and zeroes q up to pad values.
+static inline void quantizeVector(const nn_real *x, float scale, int8_t *q, int n, int pad) {
+    nn_real inv = 1 / scale;
+    #pragma omp simd
+    for (int j = 0; j < n; j++) {
+        nn_real v = x[j] * inv;
+        v = v > 127 ? 127 : v;
+        v = v < -127 ? -127 : v;
+        q[j] = (int8_t)(v + (v >= 0 ? (nn_real)0.5 : (nn_real)-0.5));
+    }
+    for (int j = n; j < pad; j++) {
+        q[j] = 0;
+    }
+}
+
+// **********************************************************
+// Frees a quantised network.
+void freeQNetwork(struct QNetwork *q) {
+    for (int l = 0; l < q->nlayers; l++) {
+        struct QLayer *Q = &q->layer[l];
+        free(Q->W);
+        free(Q->wScale);
+        free(Q->scale);
+        free(Q->corr);
+        free(Q->bias);
+    }
+    q->nlayers = 0;
+}
+
+// **********************************************************
+// Converts the weights of a network to int8 with per-row scales. The input
+// scales are set to 1 until calibrateNetwork is called. Returns 0 on
+// success, -1 (with nothing left allocated) if a layer cannot be allocated.
+int quantizeNetwork(struct QNetwork *q, const struct Network *net) {
+    q->nlayers = 0;
+    q->maxLdq = 0;
+    q->maxWidth = net->maxWidth;
+    for (int l = 0; l < net->nlayers; l++) {
+        const struct Layer *L = &net->layer[l];
+        struct QLayer *Q = &q->layer[l];
+        Q->nin = L->nin;
+        Q->nout = L->nout;
+        Q->ldq = (L->nin + QALIGN - 1) / QALIGN * QALIGN;
+        Q->act = L->act;
+        Q->W = aligned_alloc(64, (size_t)L->nout * Q->ldq);
+        Q->wScale = malloc(L->nout * sizeof(float));
+        Q->scale = malloc(L->nout * sizeof(float));
+        Q->corr = malloc(L->nout * sizeof(int32_t));
+        Q->bias = malloc(L->nout * sizeof(nn_real));
+        q->nlayers = l + 1;
+        if (Q->W == NULL || Q->wScale == NULL || Q->scale == NULL || Q->corr == NULL || Q->bias == NULL) {
+            freeQNetwork(q);
+            return -1;
+        }
+        Q->inScale = 1;
+        if (Q->ldq > q->maxLdq)
+            q->maxLdq = Q->ldq;
+        #pragma omp parallel for
+        for (int i = 0; i < L->nout; i++) {
+            const nn_weight *w = L->W + (size_t)i * L->ld;
+            int8_t *qw = Q->W + (size_t)i * Q->ldq;
+            nn_real row[L->nin];
+            nn_real max = 0;
+            for (int j = 0; j < L->nin; j++) {
+                row[j] = LOADW(w[j]);
+                max = fabs(row[j]) > max ? fabs(row[j]) : max;
+            }
+            Q->wScale[i] = max > 0 ? max / 127 : 1;
+            quantizeVector(row, Q->wScale[i], qw, L->nin, Q->ldq);
+            int32_t sum = 0;
+            for (int j = 0; j < L->nin; j++) {
+                sum += qw[j];
+            }
+            Q->corr[i] = 128 * sum;
+            Q->bias[i] = LOADW(w[L->nin]);
+            Q->scale[i] = Q->wScale[i];
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Sets the input scale of every layer from the largest absolute input it
+// receives over n samples spread evenly across the count samples of data.
+// Returns 0 on success, -1 if a thread could not allocate its scratch buffers.
+int calibrateNetwork(struct QNetwork *q, const struct Network *net, const unsigned char data[][DATA_STRIDE],
+                     const struct FeatureStats *stats, int count, int n) {
+    nn_real maxIn[MAX_LAYERS] = {0};
+    int failed = 0;
+    n = n < count ? n : count;
+    #pragma omp parallel
+    {
+        struct InferScratch *s = allocInferScratch(net);
+        nn_real localMax[MAX_LAYERS] = {0};
+        if (s == NULL) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        // every thread must agree on skipping the loop below
+        #pragma omp barrier
+        int run;
+        #pragma omp atomic read
+        run = failed;
+        run = !run;
+
+        if (run) {
+            #pragma omp for schedule(static)
+            for (int k = 0; k < n; k++) {
+                normalizeInput(data[(long)k * count / n], stats, s->in[0]);
+                forwardBlock(net, s, 1);
+                for (int l = 0; l < net->nlayers; l++) {
+                    const nn_real *x = l == 0 ? s->in[0] : s->out[l - 1];
+                    for (int j = 0; j < net->layer[l].nin; j++) {
+                        localMax[l] = fabs(x[j]) > localMax[l] ? fabs(x[j]) : localMax[l];
+                    }
+                }
+            }
+        }
+        #pragma omp critical
+        for (int l = 0; l < net->nlayers; l++) {
+            maxIn[l] = localMax[l] > maxIn[l] ? localMax[l] : maxIn[l];
+        }
+        freeInferScratch(net, s);
+    }
+    if (failed)
+        return -1;
+    for (int l = 0; l < q->nlayers; l++) {
+        struct QLayer *Q = &q->layer[l];
+        Q->inScale = maxIn[l] > 0 ? maxIn[l] / 127 : 1;
+        for (int i = 0; i < Q->nout; i++) {
+            Q->scale[i] = Q->wScale[i] * Q->inScale;
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Runs the quantised network on the normalised input in and writes the
+// outputs of the last layer to out. xq must hold maxLdq bytes and z maxWidth
+// values, both aligned to 64 bytes.
+void forwardQuantised(const struct QNetwork *q, const nn_real *in, int8_t *xq, nn_real *z, nn_real *out) {
+    const nn_real *x = in;
+    for (int l = 0; l < q->nlayers; l++) {
+        const struct QLayer *Q = &q->layer[l];
+        nn_real *y = l == q->nlayers - 1 ? out : z;
+        quantizeVector(x, Q->inScale, xq, Q->nin, Q->ldq);
+        for (int i = 0; i < Q->nout; i++) {
+            int32_t acc = dotI8(Q->W + (size_t)i * Q->ldq, xq, Q->corr[i], Q->ldq);
+            y[i] = Q->scale[i] * acc + Q->bias[i];
+        }
+        activateArray(Q->act, y, Q->nout);
+        x = y;
+    }
+}
+
+// **********************************************************
+// Classifies the count samples of data with the quantised network, in
+// parallel across samples. Same arguments as inferBatch. Returns 0 on
+// success, -1 if a thread could not allocate its buffers.
+int inferQuantised(const struct QNetwork *q, const unsigned char data[][DATA_STRIDE], const struct FeatureStats *stats,
+                   int count, int *predictions, const int *labels, double confMatrix[NCLASSES][NCLASSES]) {
+    int failed = 0;
+    #pragma omp parallel
+    {
+        nn_real *in = aligned_alloc(64, ((NINPUT + q->maxWidth + NCLASSES) * sizeof(nn_real) + 63) / 64 * 64);
+        nn_real *z = in + NINPUT;
+        nn_real *out = z + q->maxWidth;
+        int8_t *xq = aligned_alloc(64, q->maxLdq);
+        double localConf[NCLASSES][NCLASSES] = {{0}};
+        if (in == NULL || xq == NULL) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        // every thread must agree on skipping the loop below
+        #pragma omp barrier
+        int run;
+        #pragma omp atomic read
+        run = failed;
+        run = !run;
+
+        if (run) {
+            #pragma omp for schedule(static)
+            for (int k = 0; k < count; k++) {
+                normalizeInput(data[k], stats, in);
+                forwardQuantised(q, in, xq, z, out);
+                if (predictions != NULL)
+                    predictions[k] = argmaxClass(out);
+                if (labels != NULL)
+                    evaluateOutput(out, labels[k], localConf);
+            }
+        }
+        if (run && labels != NULL) {
+            #pragma omp critical
+            for (int i = 0; i < NCLASSES; i++) {
+                for (int j = 0; j < NCLASSES; j++) {
+                    confMatrix[i][j] += localConf[i][j];
+                }
+            }
+        }
+        free(in);
+        free(xq);
+    }
+    return failed ? -1 : 0;
+}
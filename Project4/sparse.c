@@ -0,0 +1,184 @@
+/*
+    Sparse-input path of the first layer.
+
+    Most raw pixels are 0 (about half of Fashion-MNIST), but normalisation
+    turns them into -mean/stddev, so the first layer, by far the largest,
+    multiplies every weight by a nonzero input. Here the normalisation is
+    folded into the first layer instead. With u = x * invStddev and
+    c = mean * invStddev the normalised input is u - c, where u is 0 for every
+    zero pixel. The weights of neuron i are kept as W_i = V_i + shift_i * c,
+    so that
+
+        W_i . (u - c) + b_i = V_i . u + shift_i * (c . u) + bias_i
+
+    with the folded bias bias_i = b_i - W_i . c. A sample is passed as the
+    list of its nonzero pixels (struct SparseSample). V is stored transposed,
+    one row of nout weights per pixel, so that every nonzero pixel adds one
+    contiguous row to the outputs of all neurons, and the forward pass reads
+    nnz rows instead of NINPUT. The SGD step W_i += g_i (u - c), b_i += g_i is
+    applied as
+
+        V_i += g_i u                          (rows of the nonzero pixels only)
+        shift_i -= g_i
+        bias_i += g_i (1 - c . u + c . c)
+
+    which is the same update in exact arithmetic: training follows the dense
+    path up to rounding.
+
+    foldInputLayer() switches the first layer to this representation and
+    unfoldInputLayer() writes the dense weights and biases back for the other
+    paths (mini-batch, inference, model files). The folded copy stays valid
+    after unfolding, until the dense weights change.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+// **********************************************************
+// STRUCTS
+// Nonzero pixels of one example.
+struct SparseSample {
+    int nnz;
+    nn_real dotC;          // c . u
+    uint16_t col[NINPUT];  // indices of the nonzero pixels
+    nn_real val[NINPUT];   // their values times invStddev (u)
+};
+
+// Folded normalisation of the first layer.
+struct InputFold {
+    nn_real c[NINPUT]; // mean * invStddev, minus the normalised value of a zero pixel
+    nn_real cc;        // c . c
+    nn_weight *VT;     // NINPUT x ldT transposed weights V
+    int ldT;           // row stride of VT, in weights
+    nn_real *shift;    // per neuron multiple of c that is left out of V
+    nn_real *bias;     // per neuron folded bias
+    int nout;          // neurons the arrays are allocated for
+};
+// **********************************************************
+// GLOBAL VARS
+struct InputFold inputFold;
+
+// **********************************************************
+// Lists the nonzero pixels of one example.
+static inline void sparseInput(const unsigned char *raw, const struct FeatureStats *stats, struct SparseSample *s) {
+    int n = 0;
+    nn_real dotC = 0;
+    for (int j = 0; j < NINPUT; j++) {
+        if (raw[j] != 0) {
+            nn_real register u = raw[j] * stats->invStddev[j];
+            s->col[n] = j;
+            s->val[n++] = u;
+            dotC += u * stats->mean[j] * stats->invStddev[j];
+        }
+    }
+    s->nnz = n;
+    s->dotC = dotC;
+}
+
+// **********************************************************
+// Copies the dense weights of the first layer to VT and sets the folded biases.
+static void foldWeights(const struct Layer *L) {
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < L->nout; i++) {
+        const nn_weight *w = L->W + (size_t)i * L->ld;
+        nn_real register wc = 0;
+        for (int j = 0; j < NINPUT; j++) {
+            inputFold.VT[(size_t)j * inputFold.ldT + i] = w[j];
+            wc += LOADW(w[j]) * inputFold.c[j];
+        }
+        inputFold.shift[i] = 0;
+        inputFold.bias[i] = LOADW(w[NINPUT]) - wc;
+    }
+}
+
+// **********************************************************
+// Switches the first layer of net to the folded representation. Returns
+// -1 (leaving the dense layer untouched) if the buffers cannot be allocated.
+int foldInputLayer(struct Network *net, const struct FeatureStats *stats) {
+    const struct Layer *L = &net->layer[0];
+    if (inputFold.nout != L->nout) {
+        int perLine = 64 / sizeof(nn_weight);
+        free(inputFold.VT);
+        free(inputFold.shift);
+        free(inputFold.bias);
+        inputFold.ldT = (L->nout + perLine - 1) / perLine * perLine;
+        inputFold.VT = aligned_alloc(64, (size_t)NINPUT * inputFold.ldT * sizeof(nn_weight));
+        inputFold.shift = malloc(L->nout * sizeof(nn_real));
+        inputFold.bias = malloc(L->nout * sizeof(nn_real));
+        inputFold.nout = L->nout;
+        if (inputFold.VT == NULL || inputFold.shift == NULL || inputFold.bias == NULL) {
+            free(inputFold.VT);
+            free(inputFold.shift);
+            free(inputFold.bias);
+            inputFold.VT = NULL;
+            inputFold.shift = NULL;
+            inputFold.bias = NULL;
+            inputFold.nout = 0;
+            return -1;
+        }
+    }
+    inputFold.cc = 0;
+    for (int j = 0; j < NINPUT; j++) {
+        inputFold.c[j] = stats->mean[j] * stats->invStddev[j];
+        inputFold.cc += inputFold.c[j] * inputFold.c[j];
+    }
+    foldWeights(L);
+    return 0;
+}
+
+// **********************************************************
+// Writes the dense weights and biases of the first layer back. step salts
+// the rounding of bf16 weights.
+void unfoldInputLayer(struct Network *net, unsigned int step) {
+    const struct Layer *L = &net->layer[0];
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < L->nout; i++) {
+        nn_weight *w = L->W + (size_t)i * L->ld;
+        nn_real register shift = inputFold.shift[i];
+        nn_real register wc = 0;
+        for (int j = 0; j < NINPUT; j++) {
+            nn_real register wj = LOADW(inputFold.VT[(size_t)j * inputFold.ldT + i]) + shift * inputFold.c[j];
+            STOREW(w[j], wj, rowSalt(step, 0, i) + j);
+            wc += wj * inputFold.c[j];
+        }
+        STOREW(w[NINPUT], inputFold.bias[i] + wc, rowSalt(step, 0, i) + NINPUT);
+    }
+    foldWeights(L); // the rounded weights define the folded copy from now on
+}
+
+// **********************************************************
+// Sets out[i] to the input of the activation of neurons [from, to) of the
+// folded first layer.
+static inline void sparseForward(const struct SparseSample *s, int from, int to, nn_real *out) {
+    for (int i = from; i < to; i++) {
+        out[i] = inputFold.shift[i] * s->dotC + inputFold.bias[i];
+    }
+    for (int k = 0; k < s->nnz; k++) {
+        const nn_weight *v = inputFold.VT + (size_t)s->col[k] * inputFold.ldT;
+        nn_real register u = s->val[k];
+        #pragma omp simd
+        for (int i = from; i < to; i++) {
+            out[i] += LOADW(v[i]) * u;
+        }
+    }
+}
+
+// **********************************************************
+// Applies the SGD step of neurons [from, to) of the folded first layer, with
+// deltas delta and learning rate lr. step salts the rounding of bf16 weights.
+static inline void sparseUpdate(const struct SparseSample *s, int from, int to, const nn_real *delta, nn_real lr,
+                                unsigned int step) {
+    for (int k = 0; k < s->nnz; k++) {
+        nn_weight *v = inputFold.VT + (size_t)s->col[k] * inputFold.ldT;
+        nn_real register u = -lr * s->val[k];
+        int register col = s->col[k];
+        #pragma omp simd
+        for (int i = from; i < to; i++) {
+            STOREW(v[i], LOADW(v[i]) + delta[i] * u, rowSalt(step, 0, i) + col);
+        }
+    }
+    nn_real register biasStep = 1 - s->dotC + inputFold.cc;
+    for (int i = from; i < to; i++) {
+        nn_real register g = -lr * delta[i];
+        inputFold.shift[i] -= g;
+        inputFold.bias[i] += g * biasStep;
+    }
+}
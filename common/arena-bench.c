@@ -0,0 +1,148 @@
+/*
+    Effect of huge pages on the access patterns of the projects (arena.c).
+
+    Allocates a BENCH_ROWS x BENCH_COLS float matrix from an arena (400 MB,
+    the size of the K-means vectors and of the pheromone matrix), once with
+    ordinary pages and once with huge pages, and times:
+    - the first touch of the whole matrix (page faults),
+    - a sequential scan of every row, like the K-means classification,
+    - reads of one cache line from random rows, like the shuffled gathers of
+      the training images and the pheromone lookups of the ants.
+
+    The dTLB load misses and page faults of every test are counted with
+    perf_event_open when the kernel allows it, and the huge pages actually
+    received are read from /proc/self/smaps_rollup.
+
+    Compile with: gcc -O2 arena-bench.c -o arena-bench -lm
+*/
+#include "arena.c"
+#include "rng.c"
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+// **********************************************************
+// DEFINITIONS
+#define BENCH_ROWS 100000  // rows of the matrix
+#define BENCH_COLS 1000    // floats per row
+#define BENCH_STRIDE ARENA_STRIDE(BENCH_COLS, float)
+#define GATHERS 20000000   // random rows read by the gather test
+#define N_TESTS 3
+
+const char *testNames[N_TESTS] = {"first touch", "sequential scan", "random gathers"};
+// **********************************************************
+// GLOBAL VARS
+volatile float sink;
+
+// **********************************************************
+// Returns a monotonic time in seconds.
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// **********************************************************
+// Opens a counter of the calling thread, or returns -1.
+int openCounter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// **********************************************************
+// Reads a counter, or returns -1 if it is not open.
+long long readCounter(int fd) {
+    long long v;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+        return -1;
+    return v;
+}
+
+// **********************************************************
+// Returns the kB of anonymous memory of the process backed by huge pages.
+long anonHugeKb(void) {
+    char line[256];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// **********************************************************
+// Runs one test on the matrix.
+void runTest(int test, float (*m)[BENCH_STRIDE]) {
+    if (test == 0) {
+        for (long i = 0; i < BENCH_ROWS; i++) {
+            for (int j = 0; j < BENCH_COLS; j++) {
+                m[i][j] = (float)j;
+            }
+        }
+    }
+    else if (test == 1) {
+        float sum = 0;
+        for (long i = 0; i < BENCH_ROWS; i++) {
+            for (int j = 0; j < BENCH_COLS; j++) {
+                sum += m[i][j];
+            }
+        }
+        sink = sum;
+    }
+    else {
+        struct Rng rng = rngStream(RNG_SEED, 0);
+        float sum = 0;
+        for (long g = 0; g < GATHERS; g++) {
+            sum += m[rngBelow(&rng, BENCH_ROWS)][g % BENCH_COLS];
+        }
+        sink = sum;
+    }
+}
+
+// **********************************************************
+int main() {
+    int tlb = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    int faults = openCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    printf("%d x %d floats, row stride %d floats (%.0f MB)\n", BENCH_ROWS, BENCH_COLS, (int)BENCH_STRIDE,
+           (double)BENCH_ROWS * BENCH_STRIDE * sizeof(float) / (1 << 20));
+    if (tlb < 0)
+        printf("dTLB miss counter unavailable\n");
+    for (int huge = 0; huge <= 1; huge++) {
+        struct Arena arena;
+        if (arenaInit(&arena, (size_t)BENCH_ROWS * BENCH_STRIDE * sizeof(float), huge) != 0) {
+            printf("Could not map the arena\n");
+            return 1;
+        }
+        float (*m)[BENCH_STRIDE] = arenaAlloc(&arena, (size_t)BENCH_ROWS * BENCH_STRIDE * sizeof(float));
+        printf("%s requested, got %s\n", huge ? "Huge pages" : "Ordinary pages", arenaPageNames[arena.pages]);
+        for (int test = 0; test < N_TESTS; test++) {
+            long long tlb0 = readCounter(tlb), faults0 = readCounter(faults);
+            double t = now();
+            runTest(test, m);
+            t = now() - t;
+            long long tlb1 = readCounter(tlb), faults1 = readCounter(faults);
+            printf("  %-16s %8.3f s", testNames[test], t);
+            if (tlb >= 0)
+                printf("  %12lld dTLB misses", tlb1 - tlb0);
+            if (faults >= 0)
+                printf("  %8lld page faults", faults1 - faults0);
+            printf("\n");
+        }
+        printf("  AnonHugePages: %ld MB\n", anonHugeKb() / 1024);
+        arenaFree(&arena);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+    Huge-page backed arena allocator shared by the projects.
+
+    The large working sets (the K-means vectors, the pheromone matrix, the
+    training images) are scanned in full or gathered row by row at random.
+    With 4 KB pages a 400 MB array spans 100k pages, far more than the TLB
+    holds, so most rows cost a page walk. An arena reserves one mapping for
+    them at runtime and backs it, in order of preference, with:
+
+    - explicit huge pages (MAP_HUGETLB), when the administrator reserved
+      enough of them in /proc/sys/vm/nr_hugepages,
+    - transparent huge pages: the mapping is aligned to ARENA_HUGE_PAGE and
+      marked with madvise(MADV_HUGEPAGE), which is enough when
+      /sys/kernel/mm/transparent_hugepage/enabled is "always" or "madvise",
+    - ordinary pages otherwise.
+
+    Allocations are carved from the mapping in order and start on 64-byte
+    boundaries. The memory is zeroed, and is only faulted in when it is first
+    touched. Rows of 2D arrays use a padded stride (ARENA_STRIDE) so that every
+    row starts on a cache line, which keeps the SIMD loads of a row aligned,
+    and a stride that is a multiple of 4 KB gets one extra line so that the
+    same column of consecutive rows does not fall in the same cache set.
+
+    Compile with -DARENA_HUGE_PAGES=0 to use ordinary pages.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef ARENA_HUGE_PAGES
+#define ARENA_HUGE_PAGES 1 // back the arenas with huge pages when possible
+#endif
+#define ARENA_ALIGN 64               // alignment of every allocation
+#define ARENA_HUGE_PAGE (2UL << 20)  // size of a huge page on x86-64
+#define ARENA_PAGES_SMALL 0          // ordinary pages
+#define ARENA_PAGES_TRANSPARENT 1    // transparent huge pages
+#define ARENA_PAGES_EXPLICIT 2       // hugetlbfs pages
+// Bytes of a row of n elements of the given type, padded to a cache line.
+#define ARENA_ROW_BYTES(n, type) (((n) * sizeof(type) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+// Padded row stride, in elements, of a 2D array with rows of n elements.
+#define ARENA_STRIDE(n, type) \
+    ((ARENA_ROW_BYTES(n, type) + (ARENA_ROW_BYTES(n, type) % 4096 == 0 ? ARENA_ALIGN : 0)) / sizeof(type))
+
+const char *arenaPageNames[3] = {"4 KB pages", "transparent huge pages", "explicit huge pages"};
+// **********************************************************
+// STRUCTS
+struct Arena {
+    char *base;
+    size_t size; // bytes mapped
+    size_t used; // bytes handed out
+    int pages;   // ARENA_PAGES_* backing the mapping
+};
+
+// **********************************************************
+// Returns 1 if transparent huge pages can be used by a madvise'd mapping.
+static int arenaTransparentEnabled(void) {
+    char mode[128] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f == NULL)
+        return 0;
+    if (fgets(mode, sizeof(mode), f) == NULL)
+        mode[0] = 0;
+    fclose(f);
+    return strstr(mode, "[always]") != NULL || strstr(mode, "[madvise]") != NULL;
+}
+
+// **********************************************************
+// Maps an arena of at least size bytes, with huge pages if hugePages is set
+// and the system provides them. Returns 0 on success.
+int arenaInit(struct Arena *a, size_t size, int hugePages) {
+    size = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+    a->size = size;
+    a->used = 0;
+    if (hugePages) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            a->base = p;
+            a->pages = ARENA_PAGES_EXPLICIT;
+            return 0;
+        }
+    }
+    // over-allocate by one huge page so that the arena can start on a boundary
+    char *p = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    char *base = (char *)(((uintptr_t)p + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+    if (base > p)
+        munmap(p, base - p);
+    if (base + size < p + size + ARENA_HUGE_PAGE)
+        munmap(base + size, p + size + ARENA_HUGE_PAGE - (base + size));
+    a->base = base;
+    a->pages = ARENA_PAGES_SMALL;
+    if (hugePages && arenaTransparentEnabled() && madvise(base, size, MADV_HUGEPAGE) == 0)
+        a->pages = ARENA_PAGES_TRANSPARENT;
+    else
+        madvise(base, size, MADV_NOHUGEPAGE); // also with THP set to "always"
+    return 0;
+}
+
+// **********************************************************
+// Returns size bytes of the arena aligned to ARENA_ALIGN, or NULL if it is full.
+void *arenaAlloc(struct Arena *a, size_t size) {
+    size_t start = (a->used + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (start + size > a->size)
+        return NULL;
+    a->used = start + size;
+    return a->base + start;
+}
+
+// **********************************************************
+// Unmaps the arena and everything allocated from it.
+void arenaFree(struct Arena *a) {
+    if (a->base != NULL)
+        munmap(a->base, a->size);
+    a->base = NULL;
+    a->size = a->used = 0;
+}
+
+// **********************************************************
+// Maps one arena for n arrays of sizes[i] bytes and sets ptrs[i] to array i.
+// Returns 0 on success, -1 (with nothing left mapped) on failure.
+int arenaInitArrays(struct Arena *a, int hugePages, int n, const size_t *sizes, void **ptrs) {
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += (sizes[i] + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    }
+    if (arenaInit(a, total, hugePages) != 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        ptrs[i] = arenaAlloc(a, sizes[i]);
+        if (ptrs[i] == NULL) {
+            arenaFree(a);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+    Dispatch overhead of the thread pool (threadpool.c) against OpenMP.
+
+    Measures, for the same number of threads:
+    - an empty parallel region (poolRun vs #pragma omp parallel),
+    - a barrier inside a region (poolBarrier vs #pragma omp barrier),
+    - a small loop like the per-neuron and per-city loops of the projects
+      (poolFor vs #pragma omp parallel for), with balanced and skewed work.
+
+    Compile with: gcc -O2 -fopenmp pool-bench.c -o pool-bench -lpthread
+    Run with OMP_NUM_THREADS=<n> to set the thread count of both.
+*/
+#include "threadpool.c"
+#include <omp.h>
+#include <stdio.h>
+#include <time.h>
+// **********************************************************
+// DEFINITIONS
+#define REPS 20000      // dispatches per measurement
+#define BARRIERS 100    // barriers per region in the barrier measurement
+#define LOOP_N 128      // iterations of the small loop
+#define WORK 200        // floating point operations per iteration
+// **********************************************************
+// GLOBAL VARS
+volatile double sink[POOL_MAX_THREADS * 8] __attribute__((aligned(64))); // one cache line per thread
+
+// **********************************************************
+// Returns a monotonic time in seconds.
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// **********************************************************
+// Some work whose cost grows with i when skewed.
+static inline void iteration(long i, int skewed) {
+    double x = i;
+    int n = skewed ? WORK * (int)(1 + 4 * i / LOOP_N) : WORK;
+    for (int k = 0; k < n; k++) {
+        x = x * 0.999 + 1;
+    }
+    sink[8 * (poolThreadId() + omp_get_thread_num())] = x; // only one of the two is not 0
+}
+
+// **********************************************************
+void emptyJob(void *arg) {
+    (void)arg;
+    __asm__ volatile("" ::: "memory");
+}
+
+void barrierJob(void *arg) {
+    (void)arg;
+    for (int b = 0; b < BARRIERS; b++) {
+        poolBarrier();
+    }
+}
+
+void loopBody(long from, long to, void *arg) {
+    for (long i = from; i < to; i++) {
+        iteration(i, *(int *)arg);
+    }
+}
+
+// **********************************************************
+int main() {
+    int nThreads = omp_get_max_threads();
+    poolStart(nThreads);
+    printf("%d threads (%d in the pool), times per dispatch\n", nThreads, poolSize());
+
+    // warm both runtimes up
+    for (int r = 0; r < 1000; r++) {
+        poolRun(emptyJob, NULL);
+        #pragma omp parallel
+        __asm__ volatile("" ::: "memory");
+    }
+
+    double t = now();
+    for (int r = 0; r < REPS; r++) {
+        poolRun(emptyJob, NULL);
+    }
+    double pool = (now() - t) / REPS;
+    t = now();
+    for (int r = 0; r < REPS; r++) {
+        #pragma omp parallel
+        __asm__ volatile("" ::: "memory");
+    }
+    double omp = (now() - t) / REPS;
+    printf("Empty region:   pool %8.2f us   OpenMP %8.2f us\n", 1e6 * pool, 1e6 * omp);
+
+    t = now();
+    for (int r = 0; r < REPS / BARRIERS; r++) {
+        poolRun(barrierJob, NULL);
+    }
+    pool = (now() - t) / REPS;
+    t = now();
+    for (int r = 0; r < REPS / BARRIERS; r++) {
+        #pragma omp parallel
+        for (int b = 0; b < BARRIERS; b++) {
+            #pragma omp barrier
+        }
+    }
+    omp = (now() - t) / REPS;
+    printf("Barrier:        pool %8.2f us   OpenMP %8.2f us\n", 1e6 * pool, 1e6 * omp);
+
+    for (int skewed = 0; skewed <= 1; skewed++) {
+        t = now();
+        for (int r = 0; r < REPS; r++) {
+            poolFor(0, LOOP_N, 4, loopBody, &skewed);
+        }
+        pool = (now() - t) / REPS;
+        t = now();
+        for (int r = 0; r < REPS; r++) {
+            #pragma omp parallel for
+            for (long i = 0; i < LOOP_N; i++) {
+                iteration(i, skewed);
+            }
+        }
+        omp = (now() - t) / REPS;
+        t = now();
+        for (int r = 0; r < REPS; r++) {
+            for (long i = 0; i < LOOP_N; i++) {
+                iteration(i, skewed);
+            }
+        }
+        double serial = (now() - t) / REPS;
+        printf("%s loop:  pool %8.2f us   OpenMP %8.2f us   serial %8.2f us\n", skewed ? "Skewed  " : "Balanced",
+               1e6 * pool, 1e6 * omp, 1e6 * serial);
+    }
+    poolStop();
+    return 0;
+}
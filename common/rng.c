@@ -0,0 +1,215 @@
+/*
+    Counter-based random number generator shared by the projects.
+
+    rand() keeps one hidden state behind a lock, so it cannot be used from
+    several threads, and any parallel use of it makes the results depend on
+    the number of threads. This module is built on Philox4x32-10 (Salmon et
+    al., "Parallel random numbers: as easy as 1, 2, 3", SC 2011), a bijection
+    that turns a 128-bit counter and a 64-bit key into 4 random 32-bit words.
+    Draw number d of a stream is word d % 4 of the block with counter
+    (d / 4, stream), under the key given by the seed. Any draw can be computed
+    directly from its index, so:
+
+    - streams are split by giving every thread, ant, layer, ... its own stream
+      number (2^64 streams of 2^66 draws each),
+    - jumping ahead is free: rngSkip() just moves the position,
+    - arrays are filled in parallel with rngUniformArray()/rngNormalArray(),
+      where element k is draw offset + k of a stream whatever the thread that
+      computes it, so the result is the same for any number of threads. They
+      generate blocks in groups of RNG_LANES, a loop the compiler turns into
+      SIMD 32x32->64 bit multiplies.
+
+    struct Rng walks a stream sequentially, for code that draws one number at
+    a time.
+*/
+#include <math.h>
+#include <stdint.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef RNG_SEED
+#define RNG_SEED 159852753 // default seed of the projects
+#endif
+#define RNG_LANES 16   // Philox blocks generated side by side
+#define RNG_CHUNK 1024 // draws generated at a time by the array functions
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+// **********************************************************
+// STRUCTS
+// Sequential reader of one stream.
+struct Rng {
+    uint32_t key[2];
+    uint64_t stream;
+    uint64_t pos;      // index of the next draw
+    uint64_t bufBlock; // block held in buf
+    uint32_t buf[4];
+};
+
+// **********************************************************
+// Encrypts the counter c in place with the key (k0, k1).
+static inline void philox4x32(uint32_t c[4], uint32_t k0, uint32_t k1) {
+    for (int r = 0; r < 10; r++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c[2];
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k1;
+        c[0] = n0;
+        c[1] = (uint32_t)p1;
+        c[2] = n2;
+        c[3] = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+// **********************************************************
+// Writes the 4 words of nBlocks consecutive blocks of a stream, starting at
+// block first, to out.
+static void philoxBlocks(uint64_t seed, uint64_t stream, uint64_t first, long nBlocks, uint32_t *out) {
+    for (long b0 = 0; b0 < nBlocks; b0 += RNG_LANES) {
+        uint32_t c0[RNG_LANES], c1[RNG_LANES], c2[RNG_LANES], c3[RNG_LANES];
+        uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+        #pragma omp simd
+        for (int j = 0; j < RNG_LANES; j++) {
+            c0[j] = (uint32_t)(first + b0 + j);
+            c1[j] = (uint32_t)((first + b0 + j) >> 32);
+            c2[j] = (uint32_t)stream;
+            c3[j] = (uint32_t)(stream >> 32);
+        }
+        for (int r = 0; r < 10; r++) {
+            #pragma omp simd
+            for (int j = 0; j < RNG_LANES; j++) {
+                uint64_t p0 = (uint64_t)PHILOX_M0 * c0[j];
+                uint64_t p1 = (uint64_t)PHILOX_M1 * c2[j];
+                uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[j] ^ k0;
+                uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3[j] ^ k1;
+                c0[j] = n0;
+                c1[j] = (uint32_t)p1;
+                c2[j] = n2;
+                c3[j] = (uint32_t)p0;
+            }
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        int n = nBlocks - b0 < RNG_LANES ? nBlocks - b0 : RNG_LANES;
+        for (int j = 0; j < n; j++) {
+            uint32_t *o = out + 4 * (b0 + j);
+            o[0] = c0[j];
+            o[1] = c1[j];
+            o[2] = c2[j];
+            o[3] = c3[j];
+        }
+    }
+}
+
+// **********************************************************
+// Maps a draw to a float in [0, 1).
+static inline float wordToFloat(uint32_t w) {
+    return (w >> 8) * 0x1p-24f;
+}
+
+// **********************************************************
+// Maps a draw to a double in (0, 1), never 0 so that its log is finite.
+static inline double wordToOpenDouble(uint32_t w) {
+    return (w + 0.5) * 0x1p-32;
+}
+
+// **********************************************************
+// Returns a reader of the given stream, positioned at its first draw.
+struct Rng rngStream(uint64_t seed, uint64_t stream) {
+    struct Rng r = {{(uint32_t)seed, (uint32_t)(seed >> 32)}, stream, 0, UINT64_MAX, {0}};
+    return r;
+}
+
+// **********************************************************
+// Jumps n draws ahead.
+static inline void rngSkip(struct Rng *r, uint64_t n) {
+    r->pos += n;
+}
+
+// **********************************************************
+// Returns the next 32 random bits of the stream.
+static inline uint32_t rngNext(struct Rng *r) {
+    uint64_t block = r->pos / 4;
+    if (block != r->bufBlock) {
+        r->buf[0] = (uint32_t)block;
+        r->buf[1] = (uint32_t)(block >> 32);
+        r->buf[2] = (uint32_t)r->stream;
+        r->buf[3] = (uint32_t)(r->stream >> 32);
+        philox4x32(r->buf, r->key[0], r->key[1]);
+        r->bufBlock = block;
+    }
+    return r->buf[r->pos++ % 4];
+}
+
+// **********************************************************
+// Returns a float uniformly distributed in [0, 1).
+static inline float rngFloat(struct Rng *r) {
+    return wordToFloat(rngNext(r));
+}
+
+// **********************************************************
+// Returns a double uniformly distributed in [0, 1), from 2 draws.
+static inline double rngDouble(struct Rng *r) {
+    uint64_t hi = rngNext(r) >> 5, lo = rngNext(r) >> 6;
+    return (hi * 67108864 + lo) * 0x1p-53;
+}
+
+// **********************************************************
+// Returns an integer in [0, n) (multiply-shift: the bias is below n / 2^32).
+static inline uint32_t rngBelow(struct Rng *r, uint32_t n) {
+    return (uint32_t)((uint64_t)rngNext(r) * n >> 32);
+}
+
+// **********************************************************
+// Returns a standard normal sample (Box-Muller, from 2 draws).
+static inline double rngNormal(struct Rng *r) {
+    double u1 = wordToOpenDouble(rngNext(r));
+    double u2 = wordToOpenDouble(rngNext(r));
+    return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// **********************************************************
+// Sets out[k] to draw offset + k of a stream, as a float uniform in [0, 1).
+void rngUniformArray(uint64_t seed, uint64_t stream, uint64_t offset, float *out, long n) {
+    uint32_t words[RNG_CHUNK + 8];
+    for (long k = 0; k < n; k += RNG_CHUNK) {
+        long len = n - k < RNG_CHUNK ? n - k : RNG_CHUNK;
+        uint64_t first = offset + k;
+        int skip = first % 4;
+        philoxBlocks(seed, stream, first / 4, (skip + len + 3) / 4, words);
+        #pragma omp simd
+        for (long j = 0; j < len; j++) {
+            out[k + j] = wordToFloat(words[skip + j]);
+        }
+    }
+}
+
+// **********************************************************
+// Sets out[k] to a standard normal sample for draw offset + k of a stream.
+// Draws 2m and 2m + 1 are the two outputs of one Box-Muller transform.
+void rngNormalArray(uint64_t seed, uint64_t stream, uint64_t offset, double *out, long n) {
+    uint32_t words[RNG_CHUNK + 8];
+    double pairs[RNG_CHUNK + 2];
+    for (long k = 0; k < n; k += RNG_CHUNK) {
+        long len = n - k < RNG_CHUNK ? n - k : RNG_CHUNK;
+        uint64_t first = (offset + k) & ~(uint64_t)1; // start of the first pair
+        int skip = first % 4;
+        int odd = (offset + k) & 1;
+        long nPairs = (odd + len + 1) / 2;
+        philoxBlocks(seed, stream, first / 4, (skip + 2 * nPairs + 3) / 4, words);
+        // Left scalar: vector log/sin/cos (libmvec) need -ffast-math and round
+        // differently from libm, which would tie the samples to the build
+        // flags, and this only runs when the weights are initialised.
+        for (long m = 0; m < nPairs; m++) {
+            double radius = sqrt(-2 * log(wordToOpenDouble(words[skip + 2 * m])));
+            double angle = 2 * M_PI * wordToOpenDouble(words[skip + 2 * m + 1]);
+            pairs[2 * m] = radius * cos(angle);
+            pairs[2 * m + 1] = radius * sin(angle);
+        }
+        for (long j = 0; j < len; j++) {
+            out[k + j] = pairs[odd + j];
+        }
+    }
+}
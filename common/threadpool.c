@@ -0,0 +1,308 @@
+/*
+    Persistent thread pool shared by the projects.
+
+    An OpenMP parallel region forks and joins its team every time it is
+    entered. When the region only holds a few microseconds of work and is
+    entered once per sample or per city, the fork and join dominate. The pool
+    starts its worker threads once, pins each one to a CPU and hands them jobs
+    through a shared descriptor:
+
+        poolRun(fn, arg)      runs fn(arg) on every thread of the pool, like a
+                              parallel region. The caller is thread 0.
+        poolFor(begin, end, grain, body, arg)
+                              splits the iterations [begin, end) between the
+                              threads, like a worksharing loop, calling
+                              body(from, to, arg) on chunks of grain
+                              iterations. Every thread starts on its own
+                              contiguous share and, once it is done, steals
+                              half of what is left of another thread's share.
+                              Inside a job every thread must call it, and it
+                              ends with a barrier. Outside a job it runs as a
+                              job of its own.
+        poolBarrier()         waits for every thread of the current job.
+
+    Waiting threads (idle workers, barriers, the end of a job) first spin on
+    the shared word for POOL_SPIN polls, which catches the next job of a hot
+    loop, and then park on a futex so that an idle pool uses no CPU. When the
+    pool has more threads than CPUs they park at once.
+
+    Jobs must be submitted by one thread at a time. A poolRun or poolFor
+    issued from inside a job runs serially on the calling thread. The pool
+    only depends on pthreads and Linux futexes, not on OpenMP.
+*/
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// **********************************************************
+// DEFINITIONS
+#ifndef POOL_SPIN
+#define POOL_SPIN 4000 // polls of a shared word before parking the thread
+#endif
+#ifndef POOL_PIN
+#define POOL_PIN 1 // pin every worker thread to a CPU
+#endif
+#define POOL_MAX_THREADS 256
+#define POOL_MAX_CPUS 1024
+// **********************************************************
+// STRUCTS
+// A word that threads wait on, with the number of threads parked on it.
+struct PoolWord {
+    int value __attribute__((aligned(64)));
+    int parked;
+};
+
+// The iterations of a worksharing loop still to be run from one thread's
+// share, [lo, hi) relative to the start of the loop, packed as lo | hi << 32
+// so that the owner and the thieves update it with a single CAS.
+struct PoolShare {
+    uint64_t range __attribute__((aligned(64)));
+};
+
+struct ThreadPool {
+    int nThreads;       // threads of the pool, the submitting thread included
+    int spin;           // polls before parking
+    int stop;
+    void (*fn)(void *); // current job
+    void *arg;
+    struct PoolWord start;   // job generation
+    struct PoolWord barrier; // barrier generation
+    int arrived __attribute__((aligned(64))); // threads waiting at the barrier
+    int cpu[POOL_MAX_THREADS];                // CPU each worker is pinned to, -1 if none
+    struct PoolShare share[POOL_MAX_THREADS];
+    pthread_t thread[POOL_MAX_THREADS];
+};
+
+typedef void (*PoolBody)(long from, long to, void *arg);
+
+// Arguments of a standalone worksharing loop.
+struct PoolLoop {
+    long begin;
+    long end;
+    long grain;
+    PoolBody body;
+    void *arg;
+};
+// **********************************************************
+// GLOBAL VARS
+struct ThreadPool pool = {.nThreads = 1};
+__thread int poolTid;  // index of the calling thread in the pool
+__thread int poolTeam; // threads of the job the calling thread is running, 0 outside jobs
+
+// **********************************************************
+// Index of the calling thread in the pool, 0 outside jobs.
+static inline int poolThreadId(void) {
+    return poolTid;
+}
+
+// **********************************************************
+// Number of threads of the pool.
+static inline int poolSize(void) {
+    return pool.nThreads;
+}
+
+// **********************************************************
+static inline void poolPause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// **********************************************************
+// Waits until w->value differs from value: spins, then parks on a futex.
+static void poolWait(struct PoolWord *w, int value) {
+    for (int i = 0; i < pool.spin; i++) {
+        if (__atomic_load_n(&w->value, __ATOMIC_ACQUIRE) != value)
+            return;
+        poolPause();
+    }
+    // parked and value are written and read in opposite orders by poolSignal,
+    // so either the waiter sees the new value or the signaller sees the waiter
+    __atomic_add_fetch(&w->parked, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&w->value, __ATOMIC_SEQ_CST) == value) {
+        syscall(SYS_futex, &w->value, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    }
+    __atomic_sub_fetch(&w->parked, 1, __ATOMIC_RELEASE);
+}
+
+// **********************************************************
+// Sets w->value and wakes the threads parked on it.
+static void poolSignal(struct PoolWord *w, int value) {
+    __atomic_store_n(&w->value, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->parked, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, &w->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// **********************************************************
+// Waits until every thread of the current job has reached the barrier.
+void poolBarrier(void) {
+    if (poolTeam <= 1)
+        return;
+    int gen = __atomic_load_n(&pool.barrier.value, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&pool.arrived, 1, __ATOMIC_ACQ_REL) == poolTeam) {
+        __atomic_store_n(&pool.arrived, 0, __ATOMIC_RELAXED);
+        poolSignal(&pool.barrier, gen + 1);
+    }
+    else {
+        poolWait(&pool.barrier, gen);
+    }
+}
+
+// **********************************************************
+// Body of the worker threads: runs every job until the pool is stopped.
+static void *poolWorker(void *arg) {
+    poolTid = (int)(intptr_t)arg;
+    if (pool.cpu[poolTid] >= 0) {
+        unsigned long mask[POOL_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+        mask[pool.cpu[poolTid] / (8 * sizeof(unsigned long))] = 1UL << pool.cpu[poolTid] % (8 * sizeof(unsigned long));
+        syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+    }
+    int gen = 0;
+    for (;;) {
+        poolWait(&pool.start, gen);
+        gen = __atomic_load_n(&pool.start.value, __ATOMIC_ACQUIRE);
+        if (pool.stop)
+            break;
+        poolTeam = pool.nThreads;
+        pool.fn(pool.arg);
+        poolBarrier();
+        poolTeam = 0;
+    }
+    return NULL;
+}
+
+// **********************************************************
+// Starts a pool of nThreads threads (the calling thread and nThreads - 1
+// workers), or one per CPU the process may run on if nThreads <= 0. Returns
+// 0 on success. If some workers cannot be started, the pool runs with fewer.
+int poolStart(int nThreads) {
+    unsigned long mask[POOL_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+    int cpus[POOL_MAX_CPUS];
+    int nCpus = 0;
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) > 0) {
+        for (int c = 0; c < POOL_MAX_CPUS; c++) {
+            if (mask[c / (8 * sizeof(unsigned long))] >> c % (8 * sizeof(unsigned long)) & 1)
+                cpus[nCpus++] = c;
+        }
+    }
+    if (nThreads <= 0)
+        nThreads = nCpus > 0 ? nCpus : 1;
+    if (nThreads > POOL_MAX_THREADS)
+        nThreads = POOL_MAX_THREADS;
+    // the submitting thread is not pinned and usually runs on the first CPU
+    for (int t = 0; t < nThreads; t++) {
+        pool.cpu[t] = POOL_PIN && nCpus > 0 && nThreads <= nCpus ? cpus[t] : -1;
+    }
+    pool.spin = nThreads <= nCpus ? POOL_SPIN : 0;
+    pool.stop = 0;
+    pool.nThreads = nThreads;
+    for (int t = 1; t < nThreads; t++) {
+        if (pthread_create(&pool.thread[t], NULL, poolWorker, (void *)(intptr_t)t) != 0) {
+            pool.nThreads = t;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// **********************************************************
+// Stops the workers. Jobs submitted afterwards run serially.
+void poolStop(void) {
+    pool.stop = 1;
+    poolSignal(&pool.start, pool.start.value + 1);
+    for (int t = 1; t < pool.nThreads; t++) {
+        pthread_join(pool.thread[t], NULL);
+    }
+    pool.nThreads = 1;
+}
+
+// **********************************************************
+// Runs fn(arg) on every thread of the pool and returns once all are done.
+void poolRun(void (*fn)(void *), void *arg) {
+    if (poolTeam != 0 || pool.nThreads == 1) {
+        int team = poolTeam;
+        poolTeam = 1;
+        fn(arg);
+        poolTeam = team;
+        return;
+    }
+    pool.fn = fn;
+    pool.arg = arg;
+    poolSignal(&pool.start, pool.start.value + 1);
+    poolTeam = pool.nThreads;
+    fn(arg);
+    poolBarrier();
+    poolTeam = 0;
+}
+
+// **********************************************************
+// Runs the calling thread's share of a worksharing loop, then steals from
+// the other threads until no iteration is left. Loops have fewer than 2^32
+// iterations.
+static void poolShareLoop(long begin, long end, long grain, PoolBody body, void *arg) {
+    int t = poolTid, n = poolTeam;
+    uint64_t total = end - begin;
+    struct PoolShare *own = &pool.share[t];
+    __atomic_store_n(&own->range, total * t / n | total * (t + 1) / n << 32, __ATOMIC_RELEASE);
+    for (;;) {
+        // own share, one grain at a time from the front
+        uint64_t r = __atomic_load_n(&own->range, __ATOMIC_ACQUIRE);
+        while ((uint32_t)r < r >> 32) {
+            uint64_t from = (uint32_t)r, to = r >> 32;
+            uint64_t next = to - from > (uint64_t)grain ? from + grain : to;
+            if (__atomic_compare_exchange_n(&own->range, &r, next | to << 32, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                body(begin + from, begin + next, arg);
+                r = __atomic_load_n(&own->range, __ATOMIC_ACQUIRE);
+            }
+        }
+        // steal the back half of the first non-empty share of another thread
+        int stolen = 0;
+        for (int k = 1; k < n && !stolen; k++) {
+            struct PoolShare *victim = &pool.share[(t + k) % n];
+            r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+            while ((uint32_t)r < r >> 32) {
+                uint64_t from = (uint32_t)r, to = r >> 32;
+                uint64_t mid = to - (to - from + 1) / 2;
+                if (__atomic_compare_exchange_n(&victim->range, &r, from | mid << 32, 0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE)) {
+                    __atomic_store_n(&own->range, mid | to << 32, __ATOMIC_RELEASE);
+                    stolen = 1;
+                    break;
+                }
+            }
+        }
+        if (!stolen)
+            break;
+    }
+}
+
+// **********************************************************
+// Job of a worksharing loop submitted from outside a job.
+static void poolLoopJob(void *arg) {
+    struct PoolLoop *loop = arg;
+    poolShareLoop(loop->begin, loop->end, loop->grain, loop->body, loop->arg);
+}
+
+// **********************************************************
+// Splits the iterations [begin, end) between the threads of the pool in
+// chunks of grain iterations (grain <= 0 picks one).
+void poolFor(long begin, long end, long grain, PoolBody body, void *arg) {
+    if (end <= begin)
+        return;
+    if (grain <= 0)
+        grain = (end - begin) / (8 * pool.nThreads) > 0 ? (end - begin) / (8 * pool.nThreads) : 1;
+    if (poolTeam == 1 || (poolTeam == 0 && pool.nThreads == 1)) {
+        body(begin, end, arg);
+    }
+    else if (poolTeam == 0) {
+        struct PoolLoop loop = {begin, end, grain, body, arg};
+        poolRun(poolLoopJob, &loop);
+    }
+    else {
+        poolShareLoop(begin, end, grain, body, arg);
+        poolBarrier();
+    }
+}